@@ -0,0 +1,1169 @@
+#include <opencv2/opencv.hpp>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <string>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <thread>
+
+#include "ppfis.h"
+#include "research project/ROI_img.h"
+
+using namespace std;
+using namespace ppfis;
+
+// compile with:
+// g++ -O2 -pthread benchmark.cpp "research project/Roi_Temp_img.cpp" -I. -o benchmark.exe $(pkg-config opencv --cflags --libs) -std=c++17
+//
+// usage: benchmark.exe [--benchmark_filter=<substring>] [--benchmark_min_time=<seconds>] [--benchmark_format=csv|json] [--benchmark_out=<file>]
+//        benchmark.exe --reference[=<seed>] [--benchmark_filter=<substring>] [--benchmark_out=<file>]
+// Progress goes to stderr, results to stdout or --benchmark_out. Times are wall clock per iteration. Input images are restored between iterations outside the timed region.
+// --reference compares every operator against OpenCV on random images instead, see reference_cases. It exits with 0 when every
+// comparison passed and with 1 when one exceeds its tolerance or the filter selects none, a CI job can gate on that exit code.
+
+struct benchmark_case
+{
+    const char* name;
+    void (*run)(mask& m, int argument);
+    int argument;
+    const char* argument_name;  // k for mean / median, nullptr when the argument is not part of the name
+    bool gray_input;  // prepared with grayscale + otsu_threshold first (morphology, sobel on binary data)
+};
+
+struct benchmark_result
+{
+    string name;
+    long iterations;
+    double real_time_ms;  // mean per iteration
+    double min_time_ms;
+    double pixels_per_second;
+};
+
+static const benchmark_case benchmark_cases[] =
+{
+    { "grayscale",      [](mask& m, int) { grayscale(m); },          0,   nullptr, false },
+    { "threshold",      [](mask& m, int t) { threshold(m, t); },     128, nullptr, false },
+    { "otsu_threshold", [](mask& m, int) { otsu_threshold(m); },     0,   nullptr, false },
+    { "adaptive_threshold", [](mask& m, int k) { adaptive_threshold(m, k); }, 15, "window", false },
+    { "sobel_operator", [](mask& m, int) { sobel_operator(m); },     0,   nullptr, false },
+    { "laplacian",      [](mask& m, int) { laplacian(m); },          0,   nullptr, false },
+    { "sharpen_filter", [](mask& m, int) { sharpen_filter(m); },     0,   nullptr, false },
+    { "mean_filter",    [](mask& m, int k) { mean_filter(m, k); },   3,   "k",     false },
+    { "mean_filter",    [](mask& m, int k) { mean_filter(m, k); },   9,   "k",     false },
+    { "median_filter",  [](mask& m, int k) { median_filter(m, k); }, 3,   "k",     false },
+    { "median_filter",  [](mask& m, int k) { median_filter(m, k); }, 5,   "k",     false },
+    { "median_filter",  [](mask& m, int k) { median_filter(m, k); }, 9,   "k",     false },
+    { "erosion",        [](mask& m, int) { erosion(m); },            0,   nullptr, true },
+    { "dilation",       [](mask& m, int) { dilation(m); },           0,   nullptr, true },
+    { "opening",        [](mask& m, int) { opening(m); },            0,   nullptr, true },
+    { "closing",        [](mask& m, int) { closing(m); },            0,   nullptr, true },
+    { "connected_components", [](mask& m, int) { connected_components(m); }, 0, nullptr, true },
+};
+
+static const cv::Size benchmark_sizes[] = { cv::Size(320, 240), cv::Size(640, 480), cv::Size(1920, 1080) };
+static const int benchmark_thread_counts[] = { 0, 1, 3, 7 };
+
+// the four ROIs Template_Matching.cpp uses on a 1920x1080 frame
+static const cv::Rect template_matching_rois[] = { cv::Rect(cv::Point(300, 300), cv::Point(1150, 750)), cv::Rect(cv::Point(950, 550), cv::Point(1800, 1000)),
+                                                   cv::Rect(cv::Point(950, 300), cv::Point(1800, 750)), cv::Rect(cv::Point(300, 550), cv::Point(1150, 1000)) };
+
+// deterministic noise over a gradient with a few solid blocks, so thresholds and morphology have structure to work on
+cv::Mat synthetic_frame(cv::Size size, unsigned seed)
+{
+    cv::Mat frame(size.height, size.width, CV_8UC3);
+    unsigned state = seed * 2654435761u + 1;
+    for (int y = 0; y < size.height; ++y)
+    {
+        uchar* row = frame.ptr(y);
+        for (int x = 0; x < size.width; ++x)
+        {
+            state ^= state << 13;
+            state ^= state >> 17;
+            state ^= state << 5;
+            int base = (x * 255) / size.width;
+            if (((x / 64) + (y / 48)) % 5 == 0)
+                base = 255 - base;
+            for (int c = 0; c < 3; ++c)
+                row[x * 3 + c] = uchar(std::max(0, std::min(255, base + int((state >> (c * 8)) & 31) - 16)));
+        }
+    }
+    return frame;
+}
+
+struct benchmark_runner
+{
+    string filter;
+    double min_time = 0.2;
+    vector<benchmark_result> results;
+
+    bool selected(const string& name) const
+    {
+        return filter.empty() || name.find(filter) != string::npos;
+    }
+
+    // restore is called before every iteration and is not timed
+    template <typename restore_function, typename run_function>
+    void measure(const string& name, double pixels, restore_function restore, run_function run)
+    {
+        if (!selected(name))
+            return;
+
+        using clock = chrono::steady_clock;
+        double total = 0, minimum = 1e300;
+        long iterations = 0;
+
+        while ((total < min_time || iterations < 3) && iterations < 100000)
+        {
+            restore();
+            clock::time_point start = clock::now();
+            run();
+            double elapsed = chrono::duration<double>(clock::now() - start).count();
+            total += elapsed;
+            minimum = std::min(minimum, elapsed);
+            ++iterations;
+        }
+
+        benchmark_result r = { name, iterations, total / iterations * 1000.0, minimum * 1000.0, pixels * iterations / total };
+        results.push_back(r);
+        cerr << name << "  " << r.real_time_ms << " ms  (" << iterations << " iterations)" << endl;
+    }
+};
+
+void operator_benchmarks(benchmark_runner& runner)
+{
+    for (const cv::Size& size : benchmark_sizes)
+    {
+        cv::Mat color = synthetic_frame(size, 1);
+        cv::Mat binary = color.clone();
+        {
+            mask m(&binary.data, binary.rows, binary.cols);
+            grayscale(m);
+            otsu_threshold(m);
+        }
+
+        cv::Mat work = color.clone();
+
+        for (const benchmark_case& c : benchmark_cases)
+            for (int threads : benchmark_thread_counts)
+            {
+                stringstream name;
+                name << c.name;
+                if (c.argument_name)
+                    name << "/" << c.argument_name << ":" << c.argument;
+                name << "/" << size.width << "x" << size.height << "/threads:" << threads;
+
+                const cv::Mat& input = c.gray_input ? binary : color;
+                runner.measure(name.str(), double(size.area()),
+                    [&]{ input.copyTo(work); },
+                    [&]{
+                        mask m(&work.data, work.rows, work.cols);
+                        m.set_thread_count(threads);
+                        c.run(m, c.argument);
+                    });
+            }
+
+        // single channel band operators, no 3 channel round trip
+        cv::Mat gray(size.height, size.width, CV_8UC1), gray_work;
+        for (int i = 0; i < size.area(); ++i)
+            gray.data[i] = color.data[i * 3];
+
+        for (int threads : benchmark_thread_counts)
+        {
+            stringstream suffix;
+            suffix << "/" << size.width << "x" << size.height << "/threads:" << threads << "/channels:1";
+
+            runner.measure("sobel_operator" + suffix.str(), double(size.area()),
+                [&]{ gray.copyTo(gray_work); },
+                [&]{
+                    mask m(&gray_work.data, gray_work.rows, gray_work.cols, 1);
+                    m.set_thread_count(threads);
+                    sobel_operator(m);
+                });
+
+            runner.measure("laplacian" + suffix.str(), double(size.area()),
+                [&]{ gray.copyTo(gray_work); },
+                [&]{
+                    mask m(&gray_work.data, gray_work.rows, gray_work.cols, 1);
+                    m.set_thread_count(threads);
+                    laplacian(m);
+                });
+        }
+
+        // the five matcher scales in one pass against five cv::resize calls
+        const double scales[5] = { 1.05, 1.00, 0.95, 0.90, 0.85 };
+        cv::Mat levels[5];
+        for (int i = 0; i < 5; ++i)
+            levels[i] = cv::Mat(scaled_size(size.height, scales[i]), scaled_size(size.width, scales[i]), CV_8UC3);
+
+        for (int threads : benchmark_thread_counts)
+        {
+            stringstream name;
+            name << "resize_levels/levels:5/" << size.width << "x" << size.height << "/threads:" << threads;
+            runner.measure(name.str(), double(size.area()), []{}, [&]{
+                mask m(&color.data, color.rows, color.cols);
+                m.set_thread_count(threads);
+                scale_level l[5];
+                for (int i = 0; i < 5; ++i)
+                    l[i] = { scales[i], levels[i].data, 0, 0 };
+                resize_levels(m, l, 5);
+            });
+        }
+
+        stringstream name;
+        name << "cv::resize/levels:5/" << size.width << "x" << size.height;
+        runner.measure(name.str(), double(size.area()), []{}, [&]{
+            for (int i = 0; i < 5; ++i)
+                cv::resize(color, levels[i], cv::Size(), scales[i], scales[i], cv::INTER_LINEAR);
+        });
+    }
+}
+
+// Image_Processing + ROI_Temp_img on a synthetic 1920x1080 frame with the template cut out of it
+void end_to_end_benchmarks(benchmark_runner& runner)
+{
+    cv::Mat frame = synthetic_frame(cv::Size(1920, 1080), 2);
+    cv::Mat templ = frame(cv::Rect(700, 500, 96, 64)).clone();
+    Image_Processing(templ, 3.0f);
+
+    const cv::Rect (&rois)[4] = template_matching_rois;
+
+    cv::Mat work;
+    runner.measure("end_to_end/Image_Processing+ROI_Temp_img/1920x1080/rois:4", 4.0 * 850 * 450,
+        [&]{ frame.copyTo(work); },
+        [&]{
+            for (const cv::Rect& roi : rois)
+            {
+                // a continuous copy of the ROI, like Template_Matching.cpp
+                scratch_scope scope;
+                cv::Mat roi_image = ROI_Image_Processing(work, roi, 3.0f);
+                ROI_Temp_img(roi_image, templ);
+            }
+        });
+
+    // the ROIs as tasks of the shared scheduler, nested with the bands of their operators like Template_Matching.cpp.
+    // Unlike there, they have no arena of their own, nested_roi_check covers the results of that.
+    struct roi_task
+    {
+        const cv::Mat* frame;
+        const cv::Mat* templ;
+        cv::Rect roi;
+    };
+    roi_task tasks[4];
+    for (int i = 0; i < 4; ++i)
+        tasks[i] = { &work, &templ, rois[i] };
+
+    runner.measure("end_to_end/Image_Processing+ROI_Temp_img/1920x1080/rois:4/tasks", 4.0 * 850 * 450,
+        [&]{ frame.copyTo(work); },
+        [&]{
+            void (*match)(roi_task*) = [](roi_task* task)
+            {
+                scratch_scope scope;
+                cv::Mat roi_image = ROI_Image_Processing(*task->frame, task->roi, 3.0f);
+                ROI_Temp_img(roi_image, *task->templ);
+            };
+            task_group group;
+            for (roi_task& task : tasks)
+                group.run(match, &task);
+            group.wait();
+        });
+
+    runner.measure("end_to_end/Image_Processing+connected_components+ROI_Temp_img/1920x1080/rois:4", 4.0 * 850 * 450,
+        [&]{ frame.copyTo(work); },
+        [&]{
+            for (const cv::Rect& roi : rois)
+            {
+                scratch_scope scope;
+                cv::Mat roi_image = ROI_Image_Processing(work, roi, 3.0f);
+                mask m(&roi_image.data, roi_image.rows, roi_image.cols);
+                m.set_thread_count(0);
+                ROI_Temp_img(roi_image, templ, connected_components(m));
+            }
+        });
+
+    // eight templates: one call per template against one shared call
+    vector<cv::Mat> templs;
+    for (int i = 0; i < 8; ++i)
+    {
+        templs.push_back(frame(cv::Rect(300 + i * 90, 320 + (i % 3) * 100, 96, 64)).clone());
+        Image_Processing(templs.back(), 3.0f);
+    }
+    cv::Mat processed = frame(rois[0]).clone();
+    Image_Processing(processed, 3.0f);
+
+    runner.measure("end_to_end/ROI_Temp_img/850x450/templates:8/per_template", 850.0 * 450, []{}, [&]{
+        for (const cv::Mat& t : templs)
+            ROI_Temp_img(processed, t);
+        scratch_arena::local().reset();
+    });
+
+    for (int threads : benchmark_thread_counts)
+        runner.measure("end_to_end/ROI_Temp_img/850x450/templates:8/shared/threads:" + to_string(threads), 850.0 * 450, []{}, [&]{
+            ROI_Temp_img(processed, templs, threads);
+            scratch_arena::local().reset();
+        });
+
+    runner.measure("end_to_end/Image_Processing/850x450", 850.0 * 450,
+        [&]{ frame(rois[0]).copyTo(work); },
+        [&]{ Image_Processing(work, 3.0f); });
+
+    runner.measure("end_to_end/Image_Processing_Local/850x450", 850.0 * 450,
+        [&]{ frame(rois[0]).copyTo(work); },
+        [&]{ Image_Processing_Local(work); });
+}
+
+// descriptor_index against a linear Hamming scan, thousands of templates with one query per blob of a frame.
+// Templates are windows of processed frames and queries the blobs of another processed frame, both from ppfis::describe.
+void search_benchmarks(benchmark_runner& runner)
+{
+    unsigned state = 7;
+    auto next = [&]{ state ^= state << 13; state ^= state >> 17; state ^= state << 5; return state; };
+
+    // windows of four processed frames at random positions and sizes
+    vector<cv::Mat> sources;
+    for (unsigned seed = 3; seed < 7; ++seed)
+    {
+        sources.push_back(synthetic_frame(cv::Size(1920, 1080), seed));
+        Image_Processing(sources.back(), 3.0f);
+    }
+    vector<descriptor> windows(16384);
+    for (descriptor& d : windows)
+    {
+        const cv::Mat& source = sources[next() % sources.size()];
+        int width = 16 + next() % 113, height = 16 + next() % 113;
+        int left = next() % (source.cols - width), top = next() % (source.rows - height);
+        d = describe(source.data, source.cols, source.channels(), left, top, left + width, top + height);
+    }
+
+    // the blobs of a processed frame, like those of the ROIs in Template_Matching.cpp
+    cv::Mat frame = synthetic_frame(cv::Size(1920, 1080), 2);
+    Image_Processing(frame, 3.0f);
+    mask m(&frame.data, frame.rows, frame.cols);
+    m.set_thread_count(3);
+    vector<component> blobs = connected_components(m);
+    vector<descriptor> queries = describe_components(m, blobs);
+    runner.measure("search/describe_components/1920x1080/blobs:" + to_string(blobs.size()), double(blobs.size()), []{}, [&]{ describe_components(m, blobs); });
+
+    for (int template_count : { 1024, 4096, 16384 })
+    {
+        descriptor_index index;
+        vector<descriptor> templates(windows.begin(), windows.begin() + template_count);
+        for (int i = 0; i < template_count; ++i)
+            index.add(templates[i], i);
+
+        stringstream suffix;
+        suffix << "/templates:" << template_count << "/queries:" << queries.size();
+
+        runner.measure("search/descriptor_index::build" + suffix.str(), double(template_count), []{}, [&]{ index.build(); });
+
+        int found = 0;
+        runner.measure("search/descriptor_index::nearest" + suffix.str(), double(queries.size()), []{}, [&]{
+            for (const descriptor& q : queries)
+                found += index.nearest(q, 24).entry >= 0;
+        });
+
+        runner.measure("search/linear_scan" + suffix.str(), double(queries.size()), []{}, [&]{
+            for (const descriptor& q : queries)
+            {
+                int best = 256;
+                for (const descriptor& t : templates)
+                    best = std::min(best, hamming_distance(q, t));
+                found += best <= 24;
+            }
+        });
+    }
+}
+
+void write_csv(ostream& out, const vector<benchmark_result>& results)
+{
+    out << "benchmark,iterations,real_time_ms,min_time_ms,pixels_per_second" << endl;
+    for (const benchmark_result& r : results)
+        out << r.name << "," << r.iterations << "," << r.real_time_ms << "," << r.min_time_ms << "," << r.pixels_per_second << endl;
+}
+
+void write_json(ostream& out, const vector<benchmark_result>& results)
+{
+    out << "{\n  \"context\": { \"hardware_concurrency\": " << thread::hardware_concurrency() << ", \"scheduler_workers\": " << scheduler::instance().worker_count() << " },\n  \"benchmarks\": [\n";
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const benchmark_result& r = results[i];
+        out << "    { \"name\": \"" << r.name << "\", \"iterations\": " << r.iterations
+            << ", \"real_time\": " << r.real_time_ms << ", \"min_time\": " << r.min_time_ms
+            << ", \"time_unit\": \"ms\", \"pixels_per_second\": " << r.pixels_per_second << " }"
+            << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}" << endl;
+}
+
+// reference mode ===
+// Every case runs the ppfis operator and an OpenCV reference of the same contract on deterministic random images.
+// max_error is taken over the image without margin pixels at each edge, edge_max_error over the whole image.
+// Operations reading through pixels::at clamp to one past the right and bottom edge, which OpenCV has no border for.
+// Their interior is compared against OpenCV and the whole image against edge, a model of that read on an input
+// with two zeroed rows below it. Otherwise both errors are compared against OpenCV. Either has to stay within
+// tolerance, edge without any. The edge_reference column names what edge_max_error was compared against, so the
+// mean and morphology edges read as a check of the baseline one-past-edge read, not of OpenCV's border handling.
+// The speedup is against the plain OpenCV function doing the same job.
+enum class reference_input
+{
+    gray,    // gray noise over a few blocks, the same in all three channels
+    binary,  // thresholded gray, for morphology and components
+    color
+};
+
+struct reference_case
+{
+    const char* name;
+    int argument;
+    reference_input input;
+    int margin;
+    int tolerance;
+    void (*run)(cv::Mat& image, int threads, int argument, cv::Mat& output);
+    void (*reference)(const cv::Mat& input, int argument, cv::Mat& output);
+    void (*opencv)(const cv::Mat& input, int argument, cv::Mat& output);
+    void (*edge)(const cv::Mat& padded, int argument, cv::Mat& output) = nullptr;
+};
+
+// pixels::at on an image with two spare rows: past the right edge the first pixel of the next row, below the last row the spare rows
+const uchar* clamped_at(const cv::Mat& padded, int x, int y)
+{
+    const int rows = padded.rows - 2;
+    size_t index = size_t(std::max(0, std::min(rows, y))) * padded.cols + std::max(0, std::min(padded.cols, x));
+    return padded.data + index * 3;
+}
+
+void mean_edge(const cv::Mat& padded, int k, cv::Mat& output)
+{
+    const int rows = padded.rows - 2, size = (k - 1) / 2;
+    output.create(rows, padded.cols, CV_8UC3);
+    for (int y = 0; y < rows; ++y)
+        for (int x = 0; x < padded.cols; ++x)
+            for (int c = 0; c < 3; ++c)
+            {
+                int sum = 0;
+                for (int dy = -size; dy <= size; ++dy)
+                    for (int dx = -size; dx <= size; ++dx)
+                        sum += clamped_at(padded, x + dx, y + dy)[c];
+                output.ptr(y)[x * 3 + c] = uchar(sum / std::pow(k, 2));
+            }
+}
+
+// 3 x 3 erosion or dilation of the r channel, in place so opening and closing can chain them
+void morphology_edge(cv::Mat& padded, bool erode)
+{
+    const int rows = padded.rows - 2;
+    cv::Mat source = padded.clone();
+    for (int y = 0; y < rows; ++y)
+        for (int x = 0; x < padded.cols; ++x)
+        {
+            bool hit = false;
+            for (int dy = -1; dy <= 1; ++dy)
+                for (int dx = -1; dx <= 1; ++dx)
+                    hit |= erode ? clamped_at(source, x + dx, y + dy)[2] != 255 : clamped_at(source, x + dx, y + dy)[2] == 255;
+            uchar value = (hit != erode) ? 255 : 0;
+            for (int c = 0; c < 3; ++c)
+                padded.ptr(y)[x * 3 + c] = value;
+        }
+}
+
+// rows of left, top, right, bottom, area in sorted order, labels are numbered differently
+void component_table(vector<array<int, 5>>& rows, cv::Mat& output)
+{
+    sort(rows.begin(), rows.end());
+    output.create(int(rows.size()), 5, CV_32S);
+    for (size_t i = 0; i < rows.size(); ++i)
+        for (int j = 0; j < 5; ++j)
+            output.ptr<int>(int(i))[j] = rows[i][j];
+}
+
+// histogram of the first channel
+void gray_histogram(const cv::Mat& input, double* bins)
+{
+    fill(bins, bins + 256, 0.0);
+    for (int y = 0; y < input.rows; ++y)
+        for (int x = 0; x < input.cols; ++x)
+            bins[input.ptr(y)[x * 3]] += 1;
+}
+
+// gray inputs are the same in all three channels, so the r channel ppfis reads and OpenCV's per channel results agree
+static const reference_case reference_cases[] =
+{
+    // (b + g + r) / 3 truncated, cvtColor weighs the channels
+    { "grayscale", 0, reference_input::color, 0, 0,
+        [](cv::Mat& image, int threads, int, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); grayscale(m); output = image; },
+        [](const cv::Mat& input, int, cv::Mat& output)
+        {
+            output.create(input.rows, input.cols, input.type());
+            for (int i = 0; i < int(input.total()); ++i)
+            {
+                const uchar* p = input.data + i * 3;
+                output.data[i * 3] = output.data[i * 3 + 1] = output.data[i * 3 + 2] = uchar((p[0] + p[1] + p[2]) / 3);
+            }
+        },
+        [](const cv::Mat& input, int, cv::Mat& output) { cv::cvtColor(input, output, cv::COLOR_BGR2GRAY); } },
+
+    // gray < t becomes 0
+    { "threshold", 128, reference_input::gray, 0, 0,
+        [](cv::Mat& image, int threads, int t, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); threshold(m, t); output = image; },
+        [](const cv::Mat& input, int t, cv::Mat& output) { cv::threshold(input, output, t - 1, 255, cv::THRESH_BINARY); },
+        [](const cv::Mat& input, int t, cv::Mat& output) { cv::threshold(input, output, t, 255, cv::THRESH_BINARY); } },
+
+    // same threshold as OpenCV, but the threshold value itself becomes 255
+    { "otsu_threshold", 0, reference_input::gray, 0, 0,
+        [](cv::Mat& image, int threads, int, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); otsu_threshold(m); output = image; },
+        [](const cv::Mat& input, int, cv::Mat& output)
+        {
+            cv::Mat gray, binary;
+            cv::extractChannel(input, gray, 0);
+            double t = cv::threshold(gray, binary, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
+            cv::threshold(input, output, t - 1, 255, cv::THRESH_BINARY);
+        },
+        [](const cv::Mat& input, int, cv::Mat& output)
+        {
+            cv::Mat gray;
+            cv::cvtColor(input, gray, cv::COLOR_BGR2GRAY);
+            cv::threshold(gray, output, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
+        } },
+
+    // one threshold is the same as otsu_threshold, OpenCV has no multi level Otsu to time against
+    { "multi_otsu_threshold", 1, reference_input::gray, 0, 0,
+        [](cv::Mat& image, int threads, int count, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); multi_otsu_threshold(m, count); output = image; },
+        [](const cv::Mat& input, int, cv::Mat& output)
+        {
+            cv::Mat gray, binary;
+            cv::extractChannel(input, gray, 0);
+            double t = cv::threshold(gray, binary, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
+            cv::threshold(input, output, t - 1, 255, cv::THRESH_BINARY);
+        },
+        [](const cv::Mat& input, int, cv::Mat& output)
+        {
+            cv::Mat gray;
+            cv::cvtColor(input, gray, cv::COLOR_BGR2GRAY);
+            cv::threshold(gray, output, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
+        } },
+
+    // Two thresholds by exhaustive search over the boundaries, the first maximum of sum^2 / weight over the classes wins.
+    // Levels are 0, 127 and 255, a value equal to a threshold goes up like in otsu_threshold.
+    { "multi_otsu_threshold", 2, reference_input::gray, 0, 0,
+        [](cv::Mat& image, int threads, int count, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); multi_otsu_threshold(m, count); output = image; },
+        [](const cv::Mat& input, int, cv::Mat& output)
+        {
+            double bins[256], weight[257] = { 0 }, sum[257] = { 0 };
+            gray_histogram(input, bins);
+            for (int i = 0; i < 256; ++i)
+            {
+                weight[i + 1] = weight[i] + bins[i];
+                sum[i + 1] = sum[i] + i * bins[i];
+            }
+            auto cost = [&](int from, int to)
+            {
+                double w = weight[to] - weight[from], s = sum[to] - sum[from];
+                return w > 0 ? s * s / w : 0.0;
+            };
+
+            // classes [0, i), [i, j), [j, 256)
+            double best = -1;
+            int first = 1, second = 2;
+            for (int j = 2; j < 256; ++j)
+            {
+                double two = -1;
+                int split = 1;
+                for (int i = 1; i < j; ++i)
+                    if (cost(0, i) + cost(i, j) > two)
+                    {
+                        two = cost(0, i) + cost(i, j);
+                        split = i;
+                    }
+                if (two + cost(j, 256) > best)
+                {
+                    best = two + cost(j, 256);
+                    first = split;
+                    second = j;
+                }
+            }
+
+            output.create(input.rows, input.cols, input.type());
+            for (int i = 0; i < int(input.total()) * 3; ++i)
+                output.data[i] = input.data[i] < first - 1 ? 0 : input.data[i] < second - 1 ? 127 : 255;
+        },
+        [](const cv::Mat& input, int, cv::Mat& output)
+        {
+            cv::Mat gray;
+            cv::cvtColor(input, gray, cv::COLOR_BGR2GRAY);
+            cv::threshold(gray, output, 0, 255, cv::THRESH_BINARY | cv::THRESH_OTSU);
+        } },
+
+    // mean - C over the window clipped to the image, which is a zero border sum divided by the clipped count
+    { "adaptive_threshold", 15, reference_input::gray, 0, 0,
+        [](cv::Mat& image, int threads, int window, cv::Mat& output)
+        {
+            mask m(&image.data, image.rows, image.cols);
+            m.set_thread_count(threads);
+            adaptive_threshold(m, window, local_threshold::mean_c, 5.0f);
+            output = image;
+        },
+        [](const cv::Mat& input, int window, cv::Mat& output)
+        {
+            cv::Mat gray, sum, count;
+            cv::extractChannel(input, gray, 0);
+            cv::boxFilter(gray, sum, CV_32S, cv::Size(window, window), cv::Point(-1, -1), false, cv::BORDER_CONSTANT);
+            cv::boxFilter(cv::Mat(gray.rows, gray.cols, CV_8UC1, cv::Scalar(1)), count, CV_32S, cv::Size(window, window), cv::Point(-1, -1), false, cv::BORDER_CONSTANT);
+            output.create(input.rows, input.cols, input.type());
+            for (int i = 0; i < int(input.total()); ++i)
+            {
+                uchar v = (gray.data[i] + 5) * count.ptr<int>()[i] < sum.ptr<int>()[i] ? 0 : 255;
+                output.data[i * 3] = output.data[i * 3 + 1] = output.data[i * 3 + 2] = v;
+            }
+        },
+        [](const cv::Mat& input, int window, cv::Mat& output)
+        {
+            cv::Mat gray;
+            cv::cvtColor(input, gray, cv::COLOR_BGR2GRAY);
+            cv::adaptiveThreshold(gray, output, 255, cv::ADAPTIVE_THRESH_MEAN_C, cv::THRESH_BINARY, window, 5);
+        } },
+
+    // l2 magnitude of the 3 x 3 gradients, truncated and saturated at 255
+    { "sobel_operator", 0, reference_input::gray, 0, 0,
+        [](cv::Mat& image, int threads, int, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); sobel_operator(m); output = image; },
+        [](const cv::Mat& input, int, cv::Mat& output)
+        {
+            cv::Mat gray, gx, gy;
+            cv::extractChannel(input, gray, 0);
+            cv::Sobel(gray, gx, CV_16S, 1, 0, 3, 1, 0, cv::BORDER_REPLICATE);
+            cv::Sobel(gray, gy, CV_16S, 0, 1, 3, 1, 0, cv::BORDER_REPLICATE);
+            cv::Mat g(gray.rows, gray.cols, CV_8UC1);
+            for (int i = 0; i < int(g.total()); ++i)
+            {
+                int x = gx.ptr<short>()[i], y = gy.ptr<short>()[i];
+                g.data[i] = uchar(std::sqrt(float(std::min(x * x + y * y, 255 * 255))));
+            }
+            cv::cvtColor(g, output, cv::COLOR_GRAY2BGR);
+        },
+        [](const cv::Mat& input, int, cv::Mat& output)
+        {
+            cv::Mat gray, gx, gy;
+            cv::cvtColor(input, gray, cv::COLOR_BGR2GRAY);
+            cv::Sobel(gray, gx, CV_16S, 1, 0);
+            cv::Sobel(gray, gy, CV_16S, 0, 1);
+            cv::addWeighted(cv::abs(gx), 1, cv::abs(gy), 1, 0, output, CV_8U);
+        } },
+
+    { "laplacian", 0, reference_input::gray, 0, 0,
+        [](cv::Mat& image, int threads, int, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); laplacian(m); output = image; },
+        [](const cv::Mat& input, int, cv::Mat& output) { cv::Laplacian(input, output, CV_8U, 1, 1, 0, cv::BORDER_REPLICATE); },
+        [](const cv::Mat& input, int, cv::Mat& output) { cv::Laplacian(input, output, CV_8U, 1); } },
+
+    { "sharpen_filter", 0, reference_input::gray, 0, 0,
+        [](cv::Mat& image, int threads, int, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); sharpen_filter(m); output = image; },
+        [](const cv::Mat& input, int, cv::Mat& output)
+        {
+            float k[9] = { 0, -1, 0, -1, 5, -1, 0, -1, 0 };
+            cv::filter2D(input, output, -1, cv::Mat(3, 3, CV_32F, k), cv::Point(-1, -1), 0, cv::BORDER_REPLICATE);
+        },
+        [](const cv::Mat& input, int, cv::Mat& output)
+        {
+            float k[9] = { 0, -1, 0, -1, 5, -1, 0, -1, 0 };
+            cv::filter2D(input, output, -1, cv::Mat(3, 3, CV_32F, k));
+        } },
+
+    // the window sum is divided as a double and truncated, cv::blur rounds
+    { "mean_filter", 3, reference_input::gray, 2, 0,
+        [](cv::Mat& image, int threads, int k, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); mean_filter(m, k); output = image; },
+        [](const cv::Mat& input, int k, cv::Mat& output)
+        {
+            cv::Mat sum;
+            cv::boxFilter(input, sum, CV_32S, cv::Size(k, k), cv::Point(-1, -1), false, cv::BORDER_REPLICATE);
+            output.create(input.rows, input.cols, input.type());
+            for (int i = 0; i < int(output.total()) * 3; ++i)
+                output.data[i] = uchar(sum.ptr<int>()[i] / (k * k));
+        },
+        [](const cv::Mat& input, int k, cv::Mat& output) { cv::blur(input, output, cv::Size(k, k)); },
+        [](const cv::Mat& padded, int k, cv::Mat& output) { mean_edge(padded, k, output); } },
+
+    { "mean_filter", 9, reference_input::gray, 5, 0,
+        [](cv::Mat& image, int threads, int k, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); mean_filter(m, k); output = image; },
+        [](const cv::Mat& input, int k, cv::Mat& output)
+        {
+            cv::Mat sum;
+            cv::boxFilter(input, sum, CV_32S, cv::Size(k, k), cv::Point(-1, -1), false, cv::BORDER_REPLICATE);
+            output.create(input.rows, input.cols, input.type());
+            for (int i = 0; i < int(output.total()) * 3; ++i)
+                output.data[i] = uchar(sum.ptr<int>()[i] / (k * k));
+        },
+        [](const cv::Mat& input, int k, cv::Mat& output) { cv::blur(input, output, cv::Size(k, k)); },
+        [](const cv::Mat& padded, int k, cv::Mat& output) { mean_edge(padded, k, output); } },
+
+    // replicated borders, the whole image has to match
+    { "median_filter", 3, reference_input::gray, 0, 0,
+        [](cv::Mat& image, int threads, int k, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); median_filter(m, k); output = image; },
+        [](const cv::Mat& input, int k, cv::Mat& output) { cv::medianBlur(input, output, k); },
+        [](const cv::Mat& input, int k, cv::Mat& output) { cv::medianBlur(input, output, k); } },
+
+    { "median_filter", 5, reference_input::gray, 0, 0,
+        [](cv::Mat& image, int threads, int k, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); median_filter(m, k); output = image; },
+        [](const cv::Mat& input, int k, cv::Mat& output) { cv::medianBlur(input, output, k); },
+        [](const cv::Mat& input, int k, cv::Mat& output) { cv::medianBlur(input, output, k); } },
+
+    { "erosion", 0, reference_input::binary, 2, 0,
+        [](cv::Mat& image, int threads, int, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); erosion(m); output = image; },
+        [](const cv::Mat& input, int, cv::Mat& output) { cv::erode(input, output, cv::Mat()); },
+        [](const cv::Mat& input, int, cv::Mat& output) { cv::erode(input, output, cv::Mat()); },
+        [](const cv::Mat& padded, int, cv::Mat& output) { cv::Mat p = padded.clone(); morphology_edge(p, true); output = p.rowRange(0, p.rows - 2); } },
+
+    { "dilation", 0, reference_input::binary, 2, 0,
+        [](cv::Mat& image, int threads, int, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); dilation(m); output = image; },
+        [](const cv::Mat& input, int, cv::Mat& output) { cv::dilate(input, output, cv::Mat()); },
+        [](const cv::Mat& input, int, cv::Mat& output) { cv::dilate(input, output, cv::Mat()); },
+        [](const cv::Mat& padded, int, cv::Mat& output) { cv::Mat p = padded.clone(); morphology_edge(p, false); output = p.rowRange(0, p.rows - 2); } },
+
+    { "opening", 0, reference_input::binary, 3, 0,
+        [](cv::Mat& image, int threads, int, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); opening(m); output = image; },
+        [](const cv::Mat& input, int, cv::Mat& output) { cv::morphologyEx(input, output, cv::MORPH_OPEN, cv::Mat()); },
+        [](const cv::Mat& input, int, cv::Mat& output) { cv::morphologyEx(input, output, cv::MORPH_OPEN, cv::Mat()); },
+        [](const cv::Mat& padded, int, cv::Mat& output) { cv::Mat p = padded.clone(); morphology_edge(p, true); morphology_edge(p, false); output = p.rowRange(0, p.rows - 2); } },
+
+    { "closing", 0, reference_input::binary, 3, 0,
+        [](cv::Mat& image, int threads, int, cv::Mat& output) { mask m(&image.data, image.rows, image.cols); m.set_thread_count(threads); closing(m); output = image; },
+        [](const cv::Mat& input, int, cv::Mat& output) { cv::morphologyEx(input, output, cv::MORPH_CLOSE, cv::Mat()); },
+        [](const cv::Mat& input, int, cv::Mat& output) { cv::morphologyEx(input, output, cv::MORPH_CLOSE, cv::Mat()); },
+        [](const cv::Mat& padded, int, cv::Mat& output) { cv::Mat p = padded.clone(); morphology_edge(p, false); morphology_edge(p, true); output = p.rowRange(0, p.rows - 2); } },
+
+    // argument is the scale in percent, fixed point rounding of OpenCV differs by at most one
+    { "resize_levels", 85, reference_input::gray, 0, 1,
+        [](cv::Mat& image, int threads, int percent, cv::Mat& output)
+        {
+            mask m(&image.data, image.rows, image.cols);
+            m.set_thread_count(threads);
+            output.create(scaled_size(image.rows, percent / 100.0), scaled_size(image.cols, percent / 100.0), image.type());
+            resize(m, output.data, percent / 100.0);
+        },
+        [](const cv::Mat& input, int percent, cv::Mat& output) { cv::resize(input, output, cv::Size(), percent / 100.0, percent / 100.0, cv::INTER_LINEAR); },
+        [](const cv::Mat& input, int percent, cv::Mat& output) { cv::resize(input, output, cv::Size(), percent / 100.0, percent / 100.0, cv::INTER_LINEAR); } },
+
+    { "resize_levels", 105, reference_input::gray, 0, 1,
+        [](cv::Mat& image, int threads, int percent, cv::Mat& output)
+        {
+            mask m(&image.data, image.rows, image.cols);
+            m.set_thread_count(threads);
+            output.create(scaled_size(image.rows, percent / 100.0), scaled_size(image.cols, percent / 100.0), image.type());
+            resize(m, output.data, percent / 100.0);
+        },
+        [](const cv::Mat& input, int percent, cv::Mat& output) { cv::resize(input, output, cv::Size(), percent / 100.0, percent / 100.0, cv::INTER_LINEAR); },
+        [](const cv::Mat& input, int percent, cv::Mat& output) { cv::resize(input, output, cv::Size(), percent / 100.0, percent / 100.0, cv::INTER_LINEAR); } },
+
+    { "resize_levels/area", 50, reference_input::gray, 0, 1,
+        [](cv::Mat& image, int threads, int percent, cv::Mat& output)
+        {
+            mask m(&image.data, image.rows, image.cols);
+            m.set_thread_count(threads);
+            output.create(scaled_size(image.rows, percent / 100.0), scaled_size(image.cols, percent / 100.0), image.type());
+            resize(m, output.data, percent / 100.0, interpolation::area);
+        },
+        [](const cv::Mat& input, int percent, cv::Mat& output) { cv::resize(input, output, cv::Size(), percent / 100.0, percent / 100.0, cv::INTER_AREA); },
+        [](const cv::Mat& input, int percent, cv::Mat& output) { cv::resize(input, output, cv::Size(), percent / 100.0, percent / 100.0, cv::INTER_AREA); } },
+
+    { "resize_levels/area", 85, reference_input::gray, 0, 1,
+        [](cv::Mat& image, int threads, int percent, cv::Mat& output)
+        {
+            mask m(&image.data, image.rows, image.cols);
+            m.set_thread_count(threads);
+            output.create(scaled_size(image.rows, percent / 100.0), scaled_size(image.cols, percent / 100.0), image.type());
+            resize(m, output.data, percent / 100.0, interpolation::area);
+        },
+        [](const cv::Mat& input, int percent, cv::Mat& output) { cv::resize(input, output, cv::Size(), percent / 100.0, percent / 100.0, cv::INTER_AREA); },
+        [](const cv::Mat& input, int percent, cv::Mat& output) { cv::resize(input, output, cv::Size(), percent / 100.0, percent / 100.0, cv::INTER_AREA); } },
+
+    // 8 connected components of 255, compared as a sorted table of bounding boxes and areas
+    { "connected_components", 0, reference_input::binary, 0, 0,
+        [](cv::Mat& image, int threads, int, cv::Mat& output)
+        {
+            mask m(&image.data, image.rows, image.cols);
+            m.set_thread_count(threads);
+            vector<array<int, 5>> rows;
+            for (const component& c : connected_components(m))
+                rows.push_back({ c.left, c.top, c.right, c.bottom, c.area });
+            component_table(rows, output);
+        },
+        [](const cv::Mat& input, int, cv::Mat& output)
+        {
+            cv::Mat gray, labels, stats, centroids;
+            cv::extractChannel(input, gray, 0);
+            int count = cv::connectedComponentsWithStats(gray, labels, stats, centroids, 8, CV_32S);
+            vector<array<int, 5>> rows;
+            for (int i = 1; i < count; ++i)
+            {
+                const int* s = stats.ptr<int>(i);
+                rows.push_back({ s[cv::CC_STAT_LEFT], s[cv::CC_STAT_TOP], s[cv::CC_STAT_LEFT] + s[cv::CC_STAT_WIDTH], s[cv::CC_STAT_TOP] + s[cv::CC_STAT_HEIGHT], s[cv::CC_STAT_AREA] });
+            }
+            component_table(rows, output);
+        },
+        [](const cv::Mat& input, int, cv::Mat& output)
+        {
+            cv::Mat gray, stats, centroids;
+            cv::cvtColor(input, gray, cv::COLOR_BGR2GRAY);
+            cv::connectedComponentsWithStats(gray, output, stats, centroids, 8, CV_32S);
+        } },
+};
+
+static const cv::Size reference_sizes[] = { cv::Size(7, 5), cv::Size(64, 48), cv::Size(333, 217), cv::Size(640, 480), cv::Size(1920, 1080) };
+
+cv::Mat reference_frame(cv::Size size, unsigned seed, reference_input input)
+{
+    cv::RNG rng(seed);
+    if (input == reference_input::color)
+    {
+        cv::Mat color(size.height, size.width, CV_8UC3);
+        rng.fill(color, cv::RNG::UNIFORM, 0, 256);
+        return color;
+    }
+
+    cv::Mat gray(size.height, size.width, CV_8UC1);
+    rng.fill(gray, cv::RNG::UNIFORM, 0, 256);
+    for (int y = 0; y < size.height; ++y)
+        for (int x = 0; x < size.width; ++x)
+            if (((x / 24) + (y / 16)) % 3 == 0)
+                gray.data[y * size.width + x] /= 4;
+    if (input == reference_input::binary)
+        cv::threshold(gray, gray, 127, 255, cv::THRESH_BINARY);
+
+    cv::Mat color;
+    cv::cvtColor(gray, color, cv::COLOR_GRAY2BGR);
+    return color;
+}
+
+// largest difference over [margin, size - margin) in both directions, -1 when nothing is left. 8 bit or 32 bit elements.
+int max_difference(const cv::Mat& a, const cv::Mat& b, int margin, int& mismatched)
+{
+    mismatched = 0;
+    if (a.size() != b.size() || a.type() != b.type())
+        return 256;
+
+    int maximum = -1;
+    const int ch = a.channels();
+    for (int y = margin; y < a.rows - margin; ++y)
+        for (int x = margin * ch; x < (a.cols - margin) * ch; ++x)
+        {
+            int d = a.depth() == CV_32S ? std::abs(a.ptr<int>(y)[x] - b.ptr<int>(y)[x]) : std::abs(int(a.ptr(y)[x]) - int(b.ptr(y)[x]));
+            maximum = std::max(maximum, d);
+            mismatched += d != 0;
+        }
+    return maximum;
+}
+
+// ROIs as tasks without their own arena, every operator takes its band arenas from local() of the thread running it.
+// A worker runs bands and whole ROIs of every group in turn, so the band arenas of one thread serve many ROIs.
+// The result has to match the ROIs processed one after another, run under ThreadSanitizer to see races as well.
+int nested_roi_check(unsigned seed, ostream& out)
+{
+    constexpr int roi_count = 24;
+    struct roi_task
+    {
+        cv::Mat image;
+    };
+    void (*process)(roi_task*) = [](roi_task* task)
+    {
+        mask m(&task->image.data, task->image.rows, task->image.cols);
+        m.set_thread_count(3);
+        grayscale(m);
+        median_filter(m, 5);
+        adaptive_threshold(m, 15);
+        opening(m);
+    };
+
+    using clock = chrono::steady_clock;
+    roi_task tasks[roi_count], expected[roi_count];
+    for (int i = 0; i < roi_count; ++i)
+    {
+        cv::Size size(160 + i * 7, 120 + i * 5);
+        // two spare rows, neighbourhood operations read one pixel past the last row and column
+        cv::Mat padded(size.height + 2, size.width, CV_8UC3, cv::Scalar(0, 0, 0));
+        tasks[i].image = padded.rowRange(0, size.height);
+        reference_frame(size, seed + unsigned(i), reference_input::gray).copyTo(tasks[i].image);
+        expected[i].image = padded.clone().rowRange(0, size.height);
+    }
+
+    clock::time_point start = clock::now();
+    for (roi_task& task : expected)
+        process(&task);
+    double serial_ms = chrono::duration<double, milli>(clock::now() - start).count();
+
+    start = clock::now();
+    {
+        task_group group;
+        for (roi_task& task : tasks)
+            group.run(process, &task);
+        group.wait();
+    }
+    double tasks_ms = chrono::duration<double, milli>(clock::now() - start).count();
+
+    int error = 0, mismatched = 0;
+    for (int i = 0; i < roi_count; ++i)
+    {
+        int m;
+        error = std::max(error, max_difference(tasks[i].image, expected[i].image, 0, m));
+        mismatched += m;
+    }
+
+    // the reference of this row is the serial run
+    out << "nested_rois/tasks:" << roi_count << ",160x120+," << 3 << "," << error << "," << mismatched << ","
+        << error << ",serial," << 0 << "," << tasks_ms << "," << serial_ms << "," << serial_ms / tasks_ms << ","
+        << (error == 0 ? "pass" : "FAIL") << endl;
+    return error == 0 ? 0 : 1;
+}
+
+// ROI_Temp_img scales the ROI with ppfis::resize_levels, scores differ slightly from the cv::resize it replaced.
+// The best location and scale on the ROIs of Template_Matching.cpp have to stay the same.
+int matcher_check(ostream& out)
+{
+    const double scales[5] = { 1.05, 1.00, 0.95, 0.90, 0.85 };
+    const double back_factors[5] = { 0.95, 1.00, 1.05, 1.10, 1.15 };
+
+    cv::Mat frame = synthetic_frame(cv::Size(1920, 1080), 2);
+    cv::Mat templ = frame(cv::Rect(700, 500, 96, 64)).clone();
+    Image_Processing(templ, 3.0f);
+
+    const cv::Rect (&rois)[4] = template_matching_rois;
+
+    using clock = chrono::steady_clock;
+    int failed = 0;
+    for (int r = 0; r < 4; ++r)
+    {
+        cv::Mat roi_image = frame(rois[r]).clone();
+        Image_Processing(roi_image, 3.0f);
+
+        clock::time_point start = clock::now();
+        RE_Matching matching = ROI_Temp_img(roi_image, templ);
+        double ppfis_ms = chrono::duration<double, milli>(clock::now() - start).count();
+
+        // the cv::resize path, the first maximum wins
+        start = clock::now();
+        double best_score = -1;
+        cv::Point best_loc(-1, -1);
+        int best = 0;
+        for (int i = 0; i < 5; ++i)
+        {
+            cv::Mat scaled, result;
+            cv::resize(roi_image, scaled, cv::Size(), scales[i], scales[i]);
+            cv::matchTemplate(scaled, templ, result, cv::TM_CCORR_NORMED);
+            double maxVal;
+            cv::Point maxLoc;
+            cv::minMaxLoc(result, nullptr, &maxVal, nullptr, &maxLoc);
+            if (100 * maxVal > best_score)
+            {
+                best_score = 100 * maxVal;
+                best_loc = cv::Point(int(maxLoc.x * back_factors[i]), int(maxLoc.y * back_factors[i]));
+                best = i + 1;
+            }
+        }
+        double opencv_ms = chrono::duration<double, milli>(clock::now() - start).count();
+
+        // max_error is the distance of the locations, a different scale counts as 256
+        int error = std::abs(matching.matchLoc.x - best_loc.x) + std::abs(matching.matchLoc.y - best_loc.y) + (matching.index != best ? 256 : 0);
+        failed += error ? 1 : 0;
+        out << "ROI_Temp_img/roi:" << r << "," << rois[r].width << "x" << rois[r].height << ",3," << error << "," << (error ? 1 : 0) << ","
+            << error << ",opencv,0," << ppfis_ms << "," << opencv_ms << "," << opencv_ms / ppfis_ms << "," << (error ? "FAIL" : "pass") << endl;
+        if (error)
+            cerr << "ROI_Temp_img roi " << r << " score " << matching.Max_score << " against " << best_score << endl;
+    }
+    return failed;
+}
+
+// ROI_Image_Processing on the ROIs of Template_Matching.cpp, which sit inside the larger frame, against the same ROIs
+// cloned first. A ROI handed to mask as a view keeps the row stride of the frame, so its pixels, blobs and match differ.
+// max_error is the largest pixel difference, plus 256 when the blobs differ and the distance of the blob matches.
+int roi_offset_check(ostream& out)
+{
+    cv::Mat frame = synthetic_frame(cv::Size(1920, 1080), 2);
+    cv::Mat templ = frame(cv::Rect(700, 500, 96, 64)).clone();
+    Image_Processing(templ, 3.0f);
+
+    using clock = chrono::steady_clock;
+    int failed = 0;
+    for (int r = 0; r < 4; ++r)
+    {
+        const cv::Rect& roi = template_matching_rois[r];
+
+        clock::time_point start = clock::now();
+        cv::Mat expected = frame(roi).clone();
+        Image_Processing(expected, 3.0f);
+        double clone_ms = chrono::duration<double, milli>(clock::now() - start).count();
+
+        scratch_scope scope;
+        start = clock::now();
+        cv::Mat processed = ROI_Image_Processing(frame, roi, 3.0f);
+        double ppfis_ms = chrono::duration<double, milli>(clock::now() - start).count();
+
+        int mismatched;
+        int error = max_difference(processed, expected, 0, mismatched);
+
+        mask processed_mask(&processed.data, processed.rows, processed.cols), expected_mask(&expected.data, expected.rows, expected.cols);
+        vector<component> blobs = connected_components(processed_mask), expected_blobs = connected_components(expected_mask);
+        bool same_blobs = blobs.size() == expected_blobs.size();
+        for (size_t i = 0; same_blobs && i < blobs.size(); ++i)
+            same_blobs = blobs[i].left == expected_blobs[i].left && blobs[i].top == expected_blobs[i].top && blobs[i].right == expected_blobs[i].right
+                && blobs[i].bottom == expected_blobs[i].bottom && blobs[i].area == expected_blobs[i].area;
+        error += same_blobs ? 0 : 256;
+
+        RE_Matching matching = ROI_Temp_img(processed, templ, blobs), expected_matching = ROI_Temp_img(expected, templ, expected_blobs);
+        error += std::abs(matching.matchLoc.x - expected_matching.matchLoc.x) + std::abs(matching.matchLoc.y - expected_matching.matchLoc.y)
+            + (matching.index != expected_matching.index ? 256 : 0);
+
+        failed += error ? 1 : 0;
+        out << "ROI_Image_Processing/roi:" << r << "," << roi.width << "x" << roi.height << ",3," << error << "," << mismatched << ","
+            << error << ",clone,0," << ppfis_ms << "," << clone_ms << "," << clone_ms / ppfis_ms << "," << (error ? "FAIL" : "pass") << endl;
+        if (error)
+            cerr << "ROI_Image_Processing roi " << r << " " << mismatched << " pixels differ, blobs " << (same_blobs ? "equal" : "differ") << endl;
+    }
+    return failed;
+}
+
+int reference_main(const string& filter, unsigned seed, ostream& out)
+{
+    using clock = chrono::steady_clock;
+    int failed = 0, compared = 0, edge_compared = 0;
+
+    out << "case,size,threads,max_error,mismatched,edge_max_error,edge_reference,tolerance,ppfis_ms,opencv_ms,speedup,result" << endl;
+
+    for (const reference_case& c : reference_cases)
+        for (size_t s = 0; s < sizeof(reference_sizes) / sizeof(reference_sizes[0]); ++s)
+        {
+            const cv::Size size = reference_sizes[s];
+            stringstream name;
+            name << c.name;
+            if (c.argument)
+                name << "/" << c.argument;
+            if (!filter.empty() && name.str().find(filter) == string::npos)
+                continue;
+
+            cv::Mat input = reference_frame(size, seed + unsigned(s), c.input);
+            cv::Mat expected, opencv_output, edge_expected;
+            c.reference(input, c.argument, expected);
+
+            // two spare rows, neighbourhood operations read one pixel past the last row and column
+            cv::Mat padded_input(size.height + 2, size.width, CV_8UC3, cv::Scalar(0, 0, 0));
+            input.copyTo(padded_input.rowRange(0, size.height));
+            if (c.edge)
+                c.edge(padded_input, c.argument, edge_expected);
+
+            double opencv_ms = 1e300;
+            for (int i = 0; i < 3; ++i)
+            {
+                clock::time_point start = clock::now();
+                c.opencv(input, c.argument, opencv_output);
+                opencv_ms = std::min(opencv_ms, chrono::duration<double, milli>(clock::now() - start).count());
+            }
+
+            for (int threads : benchmark_thread_counts)
+            {
+                cv::Mat padded = padded_input.clone(), image = padded.rowRange(0, size.height), output;
+
+                double ppfis_ms = 1e300;
+                for (int i = 0; i < 3; ++i)
+                {
+                    padded_input.copyTo(padded);
+                    clock::time_point start = clock::now();
+                    c.run(image, threads, c.argument, output);
+                    ppfis_ms = std::min(ppfis_ms, chrono::duration<double, milli>(clock::now() - start).count());
+                }
+
+                int mismatched, edge_mismatched;
+                int error = max_difference(output, expected, std::min(c.margin, std::min(size.width, size.height) / 2), mismatched);
+                int edge_error = max_difference(output, c.edge ? edge_expected : expected, 0, edge_mismatched);
+                bool passed = error <= c.tolerance && edge_error <= (c.edge ? 0 : c.tolerance);
+                failed += passed ? 0 : 1;
+                compared++;
+                edge_compared += c.edge ? 1 : 0;
+
+                out << name.str() << "," << size.width << "x" << size.height << "," << threads << "," << error << "," << mismatched << ","
+                    << edge_error << "," << (c.edge ? "baseline_edge_read" : "opencv") << "," << c.tolerance << "," << ppfis_ms << "," << opencv_ms << "," << opencv_ms / ppfis_ms << ","
+                    << (passed ? "pass" : "FAIL") << endl;
+                if (!passed)
+                    cerr << name.str() << " " << size.width << "x" << size.height << " threads:" << threads << " max error " << error << " edge " << edge_error << endl;
+            }
+        }
+
+    // the ROI checks write one row per ROI of Template_Matching.cpp
+    const int roi_count = int(sizeof(template_matching_rois) / sizeof(template_matching_rois[0]));
+    if (filter.empty() || string("nested_rois").find(filter) != string::npos)
+    {
+        failed += nested_roi_check(seed, out);
+        compared++;
+    }
+    if (filter.empty() || string("ROI_Temp_img").find(filter) != string::npos)
+    {
+        failed += matcher_check(out);
+        compared += roi_count;
+    }
+    if (filter.empty() || string("ROI_Image_Processing").find(filter) != string::npos)
+    {
+        failed += roi_offset_check(out);
+        compared += roi_count;
+    }
+
+    if (edge_compared)
+        cerr << edge_compared << " comparisons checked their edges against the baseline one-past-edge read (edge_reference baseline_edge_read), not against OpenCV's border handling" << endl;
+    cerr << failed << " of " << compared << " reference comparisons failed" << endl;
+    if (compared == 0)
+        cerr << "no reference comparison matches the filter" << endl;
+    return failed || compared == 0 ? 1 : 0;
+}
+
+int main(int argc, char** argv)
+{
+    benchmark_runner runner;
+    string format = "csv", output;
+    bool reference = false;
+    unsigned reference_seed = 1;
+
+    for (int i = 1; i < argc; ++i)
+    {
+        string argument = argv[i];
+        size_t equal = argument.find('=');
+        string key = argument.substr(0, equal), value = equal == string::npos ? "" : argument.substr(equal + 1);
+
+        if (key == "--benchmark_filter")        runner.filter = value;
+        else if (key == "--benchmark_min_time") runner.min_time = atof(value.c_str());
+        else if (key == "--benchmark_format")   format = value;
+        else if (key == "--benchmark_out")      output = value;
+        else if (key == "--reference")
+        {
+            reference = true;
+            if (!value.empty())
+                reference_seed = unsigned(atoi(value.c_str()));
+        }
+        else
+        {
+            cout << "usage: " << argv[0] << " [--benchmark_filter=<substring>] [--benchmark_min_time=<seconds>] [--benchmark_format=csv|json] [--benchmark_out=<file>]" << endl;
+            cout << "       " << argv[0] << " --reference[=<seed>] [--benchmark_filter=<substring>] [--benchmark_out=<file>]" << endl;
+            return -1;
+        }
+    }
+
+    ofstream file;
+    if (!output.empty())
+    {
+        file.open(output);
+        if (!file)
+        {
+            cout << "output file " << output << " could not be opened." << endl;
+            return -1;
+        }
+    }
+    ostream& out = output.empty() ? cout : file;
+
+    if (reference)
+        return reference_main(runner.filter, reference_seed, out);
+
+    operator_benchmarks(runner);
+    end_to_end_benchmarks(runner);
+    search_benchmarks(runner);
+
+    if (format == "json")
+        write_json(out, runner.results);
+    else
+        write_csv(out, runner.results);
+
+    return 0;
+}
@@ -1,5 +1,13 @@
 #include <opencv2/opencv.hpp>
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <map>
 
 #include "ppfis.h"
 
@@ -12,15 +20,43 @@ using namespace ppfis;
 
 void built_in_function_examples(mask& m);
 void simple_thread_exmaples();
+int batch_main(int argc, char** argv);
+bool is_raw(const filesystem::path& path);
+bool write_raw(const filesystem::path& path, const uchar* data, int width, int height, int channels);
 
 int main(int argc, char** argv)
 {
+    if (argc > 1 && string(argv[1]) == "--batch")
+        return batch_main(argc, argv);
+
     if (argc != 2)
     {
-        cout << "usage: " << argv[0] << " <Image_Path>" << endl;
+        cout << "usage: " << argv[0] << " <Image_Path|Frame.ppfr>" << endl;
+        cout << "       " << argv[0] << " --batch <Image_Directory|File_List> <Output_Directory> [--ops median:10,otsu] [--jobs 4] [--memory 512] [--threads 0] [--raw]" << endl;
         return -1;
     }
 
+    // raw frames are mapped copy on write and processed in place, no codec involved
+    if (is_raw(argv[1]))
+    {
+        raw_image input;
+        if (!input.open(argv[1]) || input.format() != raw_format::interleaved)
+        {
+            cout << "raw file " << argv[1] << " could not be opened." << endl;
+            return -1;
+        }
+
+        mask m(input.image(), input.height(), input.width(), input.channels());
+
+        built_in_function_examples(m);
+
+        write_raw("output.ppfr", *input.image(), input.width(), input.height(), input.channels());
+
+        simple_thread_exmaples();
+
+        return 0;
+    }
+
     Mat image;
     image = imread(argv[1]);
 
@@ -51,6 +87,354 @@ void built_in_function_examples(mask& m)
     otsu_threshold(m);
 }
 
+// raw frames ===
+
+bool is_raw(const filesystem::path& path)
+{
+    return path.extension() == ".ppfr";
+}
+
+bool write_raw(const filesystem::path& path, const uchar* data, int width, int height, int channels)
+{
+    raw_image output;
+    if (!output.create(path.c_str(), width, height, channels))
+        return false;
+    memcpy(*output.image(), data, size_t(width) * height * channels);
+    return true;
+}
+
+// batch mode ===
+
+struct operation
+{
+    string name;
+    int argument;
+};
+
+// "median:10,otsu,opening" -> {median, 10}, {otsu, 0}, {opening, 0}
+bool parse_operations(const string& chain, vector<operation>& operations)
+{
+    constexpr int max_window = 255;
+    static const char* known[] = { "grayscale", "threshold", "otsu", "adaptive", "sobel", "laplacian", "sharpen", "mean", "median", "erosion", "dilation", "opening", "closing" };
+
+    stringstream ss(chain);
+    string token;
+    while (getline(ss, token, ','))
+    {
+        operation op = { token, 0 };
+        size_t colon = token.find(':');
+        if (colon != string::npos)
+        {
+            op.name = token.substr(0, colon);
+            op.argument = atoi(token.substr(colon + 1).c_str());
+        }
+
+        if (find(begin(known), end(known), op.name) == end(known))
+        {
+            cout << "unknown operation " << op.name << endl;
+            return false;
+        }
+
+        // even windows are allowed, they are k - 1 wide
+        if ((op.name == "median" || op.name == "mean") && (op.argument < 1 || op.argument > max_window))
+        {
+            cout << "operation " << op.name << " needs a window size from 1 to " << max_window << ", e.g. " << op.name << ":5" << endl;
+            return false;
+        }
+        if (op.name == "threshold" && (op.argument < 0 || op.argument > 255))
+        {
+            cout << "operation threshold needs a value from 0 to 255, e.g. threshold:128" << endl;
+            return false;
+        }
+        if (op.name == "adaptive" && (op.argument < 0 || op.argument > max_window))
+        {
+            cout << "operation adaptive needs a window size from 1 to " << max_window << ", or none for 15" << endl;
+            return false;
+        }
+        operations.push_back(op);
+    }
+    return !operations.empty();
+}
+
+void apply_operations(mask& m, const vector<operation>& operations)
+{
+    for (const operation& op : operations)
+    {
+        if (op.name == "grayscale")      grayscale(m);
+        else if (op.name == "threshold") threshold(m, op.argument);
+        else if (op.name == "otsu")      otsu_threshold(m);
+        else if (op.name == "adaptive")  adaptive_threshold(m, op.argument ? op.argument : 15);
+        else if (op.name == "sobel")     sobel_operator(m);
+        else if (op.name == "laplacian") laplacian(m);
+        else if (op.name == "sharpen")   sharpen_filter(m);
+        else if (op.name == "mean")      mean_filter(m, op.argument);
+        else if (op.name == "median")    median_filter(m, op.argument);
+        else if (op.name == "erosion")   erosion(m);
+        else if (op.name == "dilation")  dilation(m);
+        else if (op.name == "opening")   opening(m);
+        else if (op.name == "closing")   closing(m);
+    }
+}
+
+struct batch
+{
+    vector<filesystem::path> inputs;
+    vector<filesystem::path> outputs;  // one per input
+    filesystem::path output_directory;
+    vector<operation> operations;
+    int mask_thread_count = 0;
+    bool raw_output = false;
+
+    atomic<size_t> next_input{0};
+    atomic<size_t> processed{0};
+    atomic<size_t> failed{0};
+
+    // bytes of decoded images currently being processed
+    mutex memory_mutex;
+    condition_variable memory_released;
+    size_t memory_budget = 0;
+    size_t memory_in_use = 0;
+
+    // bytes the last image needed, reserved up front for the next one
+    atomic<size_t> expected_memory{0};
+};
+
+// waits until bytes fit in the budget, or nothing else is in flight
+void reserve_memory(batch* b, size_t bytes)
+{
+    unique_lock<mutex> lock(b->memory_mutex);
+    b->memory_released.wait(lock, [&]{ return b->memory_in_use == 0 || b->memory_in_use + bytes <= b->memory_budget; });
+    b->memory_in_use += bytes;
+}
+
+void release_memory(batch* b, size_t bytes)
+{
+    {
+        lock_guard<mutex> lock(b->memory_mutex);
+        b->memory_in_use -= bytes;
+    }
+    b->memory_released.notify_all();
+}
+
+// Inputs keep their path below the deepest directory they all share, so equal file names from different directories
+// do not overwrite each other. Two inputs that still end up on the same output, e.g. a.png and a.ppfr with --raw, reject the batch.
+bool assign_outputs(batch& b)
+{
+    vector<filesystem::path> inputs;
+    for (const filesystem::path& input : b.inputs)
+        inputs.push_back(filesystem::absolute(input).lexically_normal());
+
+    filesystem::path root = inputs.empty() ? filesystem::path() : inputs[0].parent_path();
+    for (const filesystem::path& input : inputs)
+        while (root != root.parent_path() && (input.lexically_relative(root).empty() || *input.lexically_relative(root).begin() == ".."))
+            root = root.parent_path();
+
+    map<filesystem::path, size_t> written;
+    for (size_t i = 0; i < inputs.size(); ++i)
+    {
+        filesystem::path relative = inputs[i].lexically_relative(root);
+        filesystem::path output = b.output_directory / (relative.empty() ? inputs[i].filename() : relative);
+        if (b.raw_output)
+            output.replace_extension(".ppfr");
+        else if (is_raw(output))
+            output.replace_extension(".png");
+
+        auto inserted = written.emplace(output, i);
+        if (!inserted.second)
+        {
+            cout << "inputs " << b.inputs[inserted.first->second] << " and " << b.inputs[i] << " would both be written to " << output << endl;
+            return false;
+        }
+        b.outputs.push_back(output);
+    }
+    return true;
+}
+
+// Memory is reserved before decoding, sized like the previous image since the decoded size is not known yet.
+// Once decoded the reservation is corrected, a larger image gives its reservation back and waits for the full size.
+// An image larger than the whole budget is still processed once nothing else is in flight.
+// The budget covers image buffers only: the decoded image and the snapshot operate takes. The scratch arenas of every
+// job and band thread are not counted, they keep their peak size across images (adaptive adds 8 bytes per pixel there).
+void batch_worker(batch* b)
+{
+    size_t index;
+    while ((index = b->next_input++) < b->inputs.size())
+    {
+        const filesystem::path& input = b->inputs[index];
+
+        // operator scratch memory of the previous image is reused
+        scratch_arena::local().reset();
+
+        error_code error;
+        uintmax_t file_size = filesystem::file_size(input, error);
+        size_t reserved = max(b->expected_memory.load(), error ? size_t(0) : size_t(file_size));
+        reserve_memory(b, reserved);
+
+        // raw inputs are mapped copy on write, anything else goes through the codec
+        Mat image;
+        raw_image raw;
+        uchar** data;
+        int width, height, channels;
+
+        if (is_raw(input))
+        {
+            if (!raw.open(input.c_str()) || raw.format() != raw_format::interleaved)
+            {
+                cout << "raw file " << input << " could not be opened." << endl;
+                b->failed++;
+                release_memory(b, reserved);
+                continue;
+            }
+            data = raw.image();
+            width = raw.width();
+            height = raw.height();
+            channels = raw.channels();
+        }
+        else
+        {
+            image = imread(input.string());
+            if (image.empty() || image.type() != CV_8UC3)
+            {
+                cout << "image file " << input << " could not be opened." << endl;
+                b->failed++;
+                release_memory(b, reserved);
+                continue;
+            }
+            data = &image.data;
+            width = image.cols;
+            height = image.rows;
+            channels = 3;
+        }
+
+        // image plus the snapshot a neighbourhood operation makes
+        size_t required = size_t(width) * height * channels * 2;
+        b->expected_memory = required;
+        if (required > reserved)
+        {
+            release_memory(b, reserved);
+            reserve_memory(b, required);
+        }
+        else
+            release_memory(b, reserved - required);
+
+        mask m(data, height, width, channels);
+        m.set_thread_count(b->mask_thread_count);
+        apply_operations(m, b->operations);
+
+        bool written;
+        const filesystem::path& output = b->outputs[index];
+        if (b->raw_output)
+            written = write_raw(output, *data, width, height, channels);
+        else
+            written = imwrite(output.string(), Mat(height, width, channels == 3 ? CV_8UC3 : CV_8UC1, *data));
+
+        if (written)
+            b->processed++;
+        else
+            b->failed++;
+
+        image.release();
+        raw.close();
+        release_memory(b, required);
+    }
+}
+
+int batch_main(int argc, char** argv)
+{
+    constexpr int max_job_count = 32;
+
+    if (argc < 4)
+    {
+        cout << "usage: " << argv[0] << " --batch <Image_Directory|File_List> <Output_Directory> [--ops median:10,otsu] [--jobs 4] [--memory 512] [--threads 0] [--raw]" << endl;
+        return -1;
+    }
+
+    batch b;
+    filesystem::path source = argv[2];
+    b.output_directory = argv[3];
+
+    string chain = "median:10,otsu";
+    int job_count = 4;
+    size_t memory_megabytes = 512;
+
+    for (int i = 4; i < argc; i += 2)
+    {
+        string option = argv[i];
+        if (option == "--raw")
+        {
+            // writes .ppfr frames instead of encoding
+            b.raw_output = true;
+            --i;
+            continue;
+        }
+        if (i + 1 == argc)
+        {
+            cout << "missing value for " << option << endl;
+            return -1;
+        }
+
+        if (option == "--ops")          chain = argv[i + 1];
+        else if (option == "--jobs")    job_count = max(1, min(max_job_count, atoi(argv[i + 1])));
+        else if (option == "--memory")  memory_megabytes = max(1, atoi(argv[i + 1]));
+        else if (option == "--threads") b.mask_thread_count = atoi(argv[i + 1]);
+        else
+        {
+            cout << "unknown option " << option << endl;
+            return -1;
+        }
+    }
+    b.memory_budget = memory_megabytes * 1024 * 1024;
+
+    if (!parse_operations(chain, b.operations))
+    {
+        cout << "usage: " << argv[0] << " --batch <Image_Directory|File_List> <Output_Directory> [--ops median:10,otsu] [--jobs 4] [--memory 512] [--threads 0] [--raw]" << endl;
+        return -1;
+    }
+
+    // directory of images, or a text file with one image path per line
+    error_code error;
+    if (filesystem::is_directory(source, error))
+    {
+        for (const filesystem::directory_entry& entry : filesystem::directory_iterator(source, error))
+            if (entry.is_regular_file())
+                b.inputs.push_back(entry.path());
+        sort(b.inputs.begin(), b.inputs.end());
+    }
+    else
+    {
+        ifstream list(source);
+        if (!list)
+        {
+            cout << "input " << source << " could not be opened." << endl;
+            return -1;
+        }
+        string line;
+        while (getline(list, line))
+            if (!line.empty())
+                b.inputs.push_back(line);
+    }
+
+    if (!assign_outputs(b))
+        return -1;
+    for (const filesystem::path& output : b.outputs)
+        filesystem::create_directories(output.parent_path(), error);
+
+    auto start = chrono::steady_clock::now();
+
+    simple_thread<max_job_count, batch*> jobs(batch_worker);
+    for (int i = 0; i < job_count - 1; ++i)
+        jobs.run(&b);
+    batch_worker(&b);
+    jobs.wait();
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    cout << b.processed << " images processed, " << b.failed << " failed in " << seconds << " s ("
+         << (seconds > 0 ? b.processed / seconds : 0) << " images/sec, " << job_count << " jobs)" << endl;
+
+    return b.failed ? 1 : 0;
+}
+
 void simple_thread_exmaples()
 {
     // remove the line below if you want simple_thread examples!
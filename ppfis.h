@@ -1,8 +1,36 @@
+#pragma once
+
 #include <algorithm>
 #include <pthread.h>
 #include <tuple>
 #include <cmath>
+#include <cstring>
+#include <cstdlib>
+#include <numeric>
+#include <utility>
 #include <vector>
+#include <cstdint>
+#include <climits>
+#include <limits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <mutex>
+#include <atomic>
+#include <deque>
+#include <iterator>
+#include <thread>
+#include <condition_variable>
+
+#ifdef PPFIS_TRACE
+#include <chrono>
+#include <cstdio>
+#include <map>
+#include <ostream>
+#include <string>
+#endif
 
 typedef unsigned char uchar;
 
@@ -88,481 +116,3081 @@ namespace ppfis
         inline bool operator==(const pixel& rhs) const { return x == rhs.x && y == rhs.y && z == rhs.z; }
     };
 
-    class pixels;
-    class row_pixels;
-
-    class mask
+    // scratch arena ===
+    // Bump allocator for scratch memory that lives at most until the next reset.
+    // Chunks are kept across resets and merged into one chunk of the peak size,
+    // so once a frame has been processed the following frames do not touch the heap.
+    class scratch_arena
     {
     private:
-        constexpr static int m_mask_maximum_thread = 8;
-        int m_thread_count = 0;
+        struct chunk
+        {
+            uchar* data;
+            size_t size;
+        };
 
-        uchar** m_image_ptr = nullptr;
-        int m_image_width = -1, m_image_height = -1;
+        std::vector<chunk> m_chunks;
+        size_t m_chunk = 0, m_offset = 0;
+        size_t m_used = 0, m_peak = 0, m_capacity = 0;
+        size_t m_heap_allocations = 0;
 
-        template <typename ... parameters>
-        static void operate_per_pixel_thread(pixel* image, int image_width, void (*per_pixel_func)(pixel&, parameters ... params), int left, int right, int top, int bottom, parameters ... params);
-        template <typename ... parameters>
-        static void operate_per_pixel_thread(mask* m, pixel* new_image, void (*per_pixel_func)(pixels&, pixel&, parameters ... params), int left, int right, int top, int bottom, parameters ... params);
+        // arenas handed to the bands of an operate call, owned here so worker threads reuse them, [depth][band]
+        std::vector<std::vector<scratch_arena*>> m_bands;
+
+        static inline scratch_arena*& bound()
+        {
+            thread_local scratch_arena* arena = nullptr;
+            return arena;
+        }
 
-        friend pixels;
-        friend row_pixels;
     public:
-        int border_left = 0;
-        int border_top = 0;
-        int border_right = 0;
-        int border_bottom = 0;
+        constexpr static size_t default_chunk_size = 1 << 20;
+        constexpr static size_t default_alignment = 64;
 
-        inline int get_thread_count(void) { return m_thread_count; }
-        inline void set_thread_count(int thread_count) { m_thread_count = std::max(0, std::min(m_mask_maximum_thread, thread_count));}
+        struct marker
+        {
+            size_t chunk, offset, used;
+        };
 
-        mask(uchar** image_ptr, int image_width, int image_height);
-        void set_border(int left, int top, int right, int bottom);
-        void set_relative_border(int d_left, int d_top, int d_right, int d_bottom);
+        struct statistics
+        {
+            size_t used;              // bytes handed out since the last reset, including alignment
+            size_t peak;              // highest used since construction
+            size_t capacity;          // bytes held in chunks
+            size_t chunks;
+            size_t heap_allocations;  // chunks allocated since construction
+        };
 
-        template <typename ... parameters>
-        bool operate(void (*per_pixel_func)(pixel& current_pixel, parameters ... params), parameters ... params);
-        template <typename ... parameters>
-        bool operate(void (*per_pixel_func)(pixels& original_pixel, pixel& output_pixel, parameters ... params), parameters ... params);
-    };
+        inline scratch_arena() {}
+        inline ~scratch_arena()
+        {
+            release();
+            for (std::vector<scratch_arena*>& level : m_bands)
+                for (scratch_arena* b : level)
+                    delete b;
+        }
+        scratch_arena(const scratch_arena&) = delete;
+        scratch_arena& operator=(const scratch_arena&) = delete;
 
-    class row_pixels
-    {
-    private:
-        const mask* m_mask_ptr;
-        int m_current_row;
-        int m_current_column;
-    
-        inline row_pixels(int current_row, int current_column, const mask* mask_ptr) : m_current_row(current_row), m_current_column(current_column), m_mask_ptr(mask_ptr) {}
-        
-        friend pixels;
+        // arena of the calling thread, or the one bound with scratch_binding
+        static inline scratch_arena& local()
+        {
+            thread_local scratch_arena arena;
+            return bound() ? *bound() : arena;
+        }
 
-    public:
-        inline const pixel& operator[](int relative_column)
+        // depth is the number of operate calls around this one on the calling thread. A thread waiting for its bands
+        // may run an unrelated task whose operate call gets this arena as local() too, it must not get the same bands.
+        inline scratch_arena& band(int depth, int index)
         {
-            int row = std::max(0,std::min(m_mask_ptr->m_image_width, m_current_row));
-            int column = std::max(0,std::min(m_mask_ptr->m_image_height, m_current_column + relative_column));
-            return reinterpret_cast<pixel*>(*m_mask_ptr->m_image_ptr)[column * m_mask_ptr->m_image_width + row];
+            if (int(m_bands.size()) <= depth)
+                m_bands.resize(depth + 1);
+            std::vector<scratch_arena*>& level = m_bands[depth];
+            while (int(level.size()) <= index)
+                level.push_back(new scratch_arena());
+            return *level[index];
         }
-    };
 
-    class pixels
-    {
-    private:
-        const mask* m_mask_ptr;
-        int m_current_row;
-        int m_current_column;
+        inline void* allocate(size_t size, size_t alignment = default_alignment)
+        {
+            while (m_chunk < m_chunks.size())
+            {
+                chunk& c = m_chunks[m_chunk];
+                size_t start = (reinterpret_cast<uintptr_t>(c.data) + m_offset + alignment - 1) / alignment * alignment - reinterpret_cast<uintptr_t>(c.data);
+                if (start + size <= c.size)
+                {
+                    m_used += start + size - m_offset;
+                    m_peak = std::max(m_peak, m_used);
+                    m_offset = start + size;
+                    return c.data + start;
+                }
+                // the rest of a chunk that is too small is skipped
+                m_used += c.size - m_offset;
+                ++m_chunk;
+                m_offset = 0;
+            }
 
-        inline pixels() {}
+            size_t chunk_size = std::max(std::max(default_chunk_size, m_capacity), size + alignment);
+            m_chunks.push_back({ new uchar[chunk_size], chunk_size });
+            m_capacity += chunk_size;
+            ++m_heap_allocations;
+            return allocate(size, alignment);
+        }
 
-        friend mask;
-    public:
-        inline const pixel& at(int relative_row, int relative_column)
+        template <typename T>
+        inline T* allocate_array(size_t count)
         {
-            int row = std::max(0,std::min(m_mask_ptr->m_image_width, m_current_row + relative_row));
-            int column = std::max(0,std::min(m_mask_ptr->m_image_height, m_current_column + relative_column));
-            return reinterpret_cast<pixel*>(*m_mask_ptr->m_image_ptr)[column * m_mask_ptr->m_image_width + row];
+            return reinterpret_cast<T*>(allocate(sizeof(T) * count, std::max(alignof(T), default_alignment)));
         }
 
-        inline row_pixels operator[](int relative_row) const { return row_pixels(m_current_row + relative_row, m_current_column, m_mask_ptr); }
-    };
+        inline marker mark() const { return { m_chunk, m_offset, m_used }; }
 
-    template <typename ... parameters>
-    inline void mask::operate_per_pixel_thread(pixel* image, int image_width, void (*per_pixel_func)(pixel&, parameters ...), int left, int right, int top, int bottom, parameters ... params)
-    {
-        for (int c = top; c < bottom; ++c)
-            for (int r = left; r < right; ++r)
-                per_pixel_func(image[c * image_width + r], params...);
-    }
+        inline void rewind(const marker& m)
+        {
+            m_chunk = m.chunk;
+            m_offset = m.offset;
+            m_used = m.used;
+        }
 
-    template <typename ... parameters>
-    inline void mask::operate_per_pixel_thread(mask* m, pixel* new_image, void (*per_pixel_func)(pixels&, pixel&, parameters ...), int left, int right, int top, int bottom, parameters ... params)
-    {
-        pixels op;
-        op.m_mask_ptr = m;
-        for (int c = top; c < bottom; ++c)
-            for (int r = left; r < right; ++r)
+        // call once per frame, everything allocated before becomes invalid
+        inline void reset()
+        {
+            if (m_chunks.size() > 1)
             {
-                op.m_current_column = c;
-                op.m_current_row = r;
-                per_pixel_func(op, new_image[c * m->m_image_width + r], params...);
+                size_t size = std::max(m_peak, m_capacity);
+                release();
+                m_chunks.push_back({ new uchar[size], size });
+                m_capacity = size;
+                ++m_heap_allocations;
             }
-    }
+            m_chunk = 0;
+            m_offset = 0;
+            m_used = 0;
+            for (std::vector<scratch_arena*>& level : m_bands)
+                for (scratch_arena* b : level)
+                    b->reset();
+        }
 
-    inline mask::mask(uchar** image_ptr, int image_width, int image_height) : m_image_ptr(image_ptr), m_image_width(image_height), m_image_height(image_width)
-    {
-        border_left = 0;
-        border_top = 0;
-        border_right = image_height;
-        border_bottom = image_width;
-    }
+        // frees all chunks, statistics are kept
+        inline void release()
+        {
+            for (chunk& c : m_chunks)
+                delete[] c.data;
+            m_chunks.clear();
+            m_chunk = 0;
+            m_offset = 0;
+            m_used = 0;
+            m_capacity = 0;
+        }
 
-    inline void mask::set_border(int left, int top, int right, int bottom)
-    {
-        border_left = left;
-        border_top = top;
-        border_right = right;
-        border_bottom = bottom;
-    }
+        // band arenas are included
+        inline statistics get_statistics() const
+        {
+            statistics s = { m_used, m_peak, m_capacity, m_chunks.size(), m_heap_allocations };
+            for (const std::vector<scratch_arena*>& level : m_bands)
+                for (const scratch_arena* b : level)
+                {
+                    statistics bs = b->get_statistics();
+                    s.used += bs.used;
+                    s.peak += bs.peak;
+                    s.capacity += bs.capacity;
+                    s.chunks += bs.chunks;
+                    s.heap_allocations += bs.heap_allocations;
+                }
+            return s;
+        }
 
-    inline void mask::set_relative_border(int d_left, int d_top, int d_right, int d_bottom)
-    {
-        border_left = 0 + d_left;
-        border_top = 0 + d_top;
-        border_right = m_image_width - d_right;
-        border_bottom = m_image_height - d_bottom;
-    }
+        friend class scratch_binding;
+    };
 
-    template <typename ... parameters>
-    inline bool mask::operate(void (*per_pixel_func)(pixel& current_pixel, parameters ... params), parameters ... params)
+    // makes scratch_arena::local() return the given arena on this thread, for threads that are created per frame
+    class scratch_binding
     {
-        if (!m_image_ptr || !per_pixel_func) return false;
-
-        // map ranges due to borders
-        int right = std::min(std::max(border_left, border_right), m_image_width);
-        int left = std::max(std::min(border_left, right), 0);
-        int bottom = std::min(std::max(border_top, border_bottom), m_image_height);
-        int top = std::max(std::min(border_top, bottom), 0);
-
-        simple_thread<m_mask_maximum_thread, pixel*, int, void (*)(pixel&, parameters...), int, int, int, int, parameters ... > t(mask::operate_per_pixel_thread);
-
-        pixel* image = reinterpret_cast<pixel*>(*m_image_ptr);
-
-        // estimate thread count
-        int concurrent_operation_count = bottom - top > m_thread_count + 1 ? m_thread_count + 1 : 1;
-        int height_per_thread = (bottom - top) / concurrent_operation_count;
-
-        // run threads
-        for (int i = 0; i < concurrent_operation_count - 1; ++i)
-            t.run(image, m_image_width, per_pixel_func, left, right, top + height_per_thread * i, top + height_per_thread * (i + 1), params...);
-        operate_per_pixel_thread(image, m_image_width, per_pixel_func, left, right, top + height_per_thread * (concurrent_operation_count - 1), bottom, params...);
+    private:
+        scratch_arena* m_previous;
 
-        t.wait();
-        return true;
-    }
+    public:
+        inline scratch_binding(scratch_arena& arena) : m_previous(scratch_arena::bound()) { scratch_arena::bound() = &arena; }
+        inline ~scratch_binding() { scratch_arena::bound() = m_previous; }
+        scratch_binding(const scratch_binding&) = delete;
+        scratch_binding& operator=(const scratch_binding&) = delete;
+    };
 
-    template <typename ... parameters>
-    inline bool mask::operate(void (*per_pixel_func)(pixels& original_pixel, pixel& output_pixel, parameters ... params), parameters ... params)
+    // rewinds the arena when leaving the scope
+    class scratch_scope
     {
-        if (!m_image_ptr || !per_pixel_func) return false;
+    private:
+        scratch_arena& m_arena;
+        scratch_arena::marker m_marker;
 
-        // create new image
-        pixel* new_image = new pixel[m_image_width * m_image_height];
-        memcpy(new_image, *m_image_ptr, m_image_width * m_image_height * 3);
+    public:
+        inline scratch_scope(scratch_arena& arena = scratch_arena::local()) : m_arena(arena), m_marker(arena.mark()) {}
+        inline ~scratch_scope() { m_arena.rewind(m_marker); }
+        scratch_scope(const scratch_scope&) = delete;
+        scratch_scope& operator=(const scratch_scope&) = delete;
+    };
 
-        // map ranges due to borders
-        int right = std::min(std::max(border_left, border_right), m_image_width);
-        int left = std::max(std::min(border_left, right), 0);
-        int bottom = std::min(std::max(border_top, border_bottom), m_image_height);
-        int top = std::max(std::min(border_top, bottom), 0);
+#ifdef PPFIS_TRACE
+    // tracing ===
+    // Compiled in with -DPPFIS_TRACE only. Every operate call records one event per band, operators record
+    // one event for the whole call through PPFIS_TRACE_SCOPE, including the pixels and bytes of their operate calls.
+    struct trace_event
+    {
+        const char* name;
+        const char* category;  // "operator" or "band"
+        int64_t start, end;    // nanoseconds since the trace started
+        int thread;
+        long call;             // operate call a band belongs to, 0 for operators
+        long pixels;
+        long bytes;
+    };
 
-        simple_thread<m_mask_maximum_thread, mask*, pixel*, void (*)(pixels&, pixel&, parameters...), int, int, int, int, parameters ... > t(mask::operate_per_pixel_thread);
+    class trace
+    {
+    private:
+        std::mutex m_mutex;
+        std::vector<trace_event> m_events;
+        size_t m_dropped = 0;
 
-        // estimate thread count
-        int concurrent_operation_count = bottom - top > m_thread_count + 1 ? m_thread_count + 1 : 1;
-        int height_per_thread = (bottom - top) / concurrent_operation_count;
+        static inline std::chrono::steady_clock::time_point epoch()
+        {
+            static const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            return start;
+        }
 
-        // run threads
-        for (int i = 0; i < concurrent_operation_count - 1; ++i)
-            t.run(this, new_image, per_pixel_func, left, right, top + height_per_thread * i, top + height_per_thread * (i + 1), params...);
-        operate_per_pixel_thread(this, new_image, per_pixel_func, left, right, top + height_per_thread * (concurrent_operation_count - 1), bottom, params...);
+        static inline double percentile(const std::vector<int64_t>& sorted, double p)
+        {
+            return sorted.empty() ? 0 : sorted[std::min(sorted.size() - 1, size_t(p * sorted.size()))] / 1e6;
+        }
 
-        t.wait();
+    public:
+        constexpr static size_t maximum_event_count = 1 << 22;
 
-        // copy result
-        memcpy(*m_image_ptr, new_image, m_image_width * m_image_height * 3);
-        delete[] new_image;
-        return true;
-    }
+        static inline trace& instance()
+        {
+            static trace t;
+            return t;
+        }
 
-    inline void grayscale(mask& m)
-    {
-        void (*func)(pixel& p) = [](pixel& p)
+        static inline int64_t now()
         {
-            uchar gray = uchar((int(p.r) + int(p.g) + int(p.b))/3);
-            p = gray;
-        };
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch()).count();
+        }
 
-        m.operate(func);
-    }
+        // small sequential id instead of pthread_t, so the trace viewer shows one row per thread
+        static inline int thread_id()
+        {
+            static std::atomic<int> next_id{1};
+            thread_local int id = next_id++;
+            return id;
+        }
 
-    // threshold
-    inline void threshold(mask& m, int threshold)
-    {
-        grayscale(m);
+        static inline long next_call()
+        {
+            static std::atomic<long> next{1};
+            return next++;
+        }
 
-        constexpr void (*func)(pixel&, int) = [](pixel& p, int threshold)
+        inline void record(const trace_event& e)
         {
-            if (p.r < threshold)
-                p = 0;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_events.size() < maximum_event_count)
+                m_events.push_back(e);
             else
-                p = 255; 
-        };
+                ++m_dropped;
+        }
 
-        m.operate(func, threshold);
-    }
-    
-    inline void compute_hist(mask& m, unsigned* hist)
-    {
-        // make it publicly available?
+        inline void clear()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_events.clear();
+            m_dropped = 0;
+        }
 
-        int prev_thread_count = m.get_thread_count();
-        m.set_thread_count(0); // avoid data race problem 
+        inline std::vector<trace_event> events()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_events;
+        }
 
-        constexpr void (*func)(pixel&, unsigned*) = [](pixel& p, unsigned* hist)
+        // chrome://tracing or ui.perfetto.dev
+        inline void write_chrome_json(std::ostream& out)
         {
-            hist[p.r]++; 
-        };
+            std::vector<trace_event> all = events();
+            out << "{\"traceEvents\":[";
+            for (size_t i = 0; i < all.size(); ++i)
+            {
+                const trace_event& e = all[i];
+                out << (i ? ",\n" : "\n") << "{\"name\":\"" << e.name << "\",\"cat\":\"" << e.category << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.thread
+                    << ",\"ts\":" << e.start / 1000.0 << ",\"dur\":" << (e.end - e.start) / 1000.0
+                    << ",\"args\":{\"pixels\":" << e.pixels << ",\"bytes\":" << e.bytes << ",\"call\":" << e.call << "}}";
+            }
+            out << "\n],\"displayTimeUnit\":\"ms\"}" << std::endl;
+        }
 
-        m.operate(func, hist);
+        // per operator latency percentiles and a log2 histogram,
+        // imbalance is the slowest band over the mean band of each operate call, averaged over the calls
+        inline void write_summary(std::ostream& out)
+        {
+            std::vector<trace_event> all = events();
 
-        m.set_thread_count(prev_thread_count);
-    }
+            std::map<std::string, std::vector<const trace_event*>> operators, bands;
+            std::map<long, std::vector<const trace_event*>> calls;
+            for (const trace_event& e : all)
+            {
+                if (strcmp(e.category, "band") == 0)
+                {
+                    bands[e.name].push_back(&e);
+                    calls[e.call].push_back(&e);
+                }
+                else
+                    operators[e.name].push_back(&e);
+            }
 
-    inline int compute_otsu(mask& m, unsigned *hist)
-    {
-        // Need to get the size of mask
-        long int N = (m.border_right - m.border_left) * (m.border_bottom - m.border_top);
-        int threshold = 0;
+            std::map<std::string, std::pair<double, int>> imbalance;
+            for (const auto& call : calls)
+            {
+                if (call.second.size() < 2)
+                    continue;
+                int64_t longest = 0, total = 0;
+                for (const trace_event* e : call.second)
+                {
+                    longest = std::max(longest, e->end - e->start);
+                    total += e->end - e->start;
+                }
+                std::pair<double, int>& entry = imbalance[call.second.front()->name];
+                entry.first += total ? double(longest) * call.second.size() / total : 1.0;
+                entry.second++;
+            }
 
-        float sum = 0;
-        float sumB = 0;
-        int q1 = 0;
-        int q2 = 0;
-        float varMax = 0;
+            out << "operator                      calls    total ms   mean ms    p50 ms    p90 ms    p99 ms    max ms   Mpix/s    MB/s  imbalance" << std::endl;
+            for (int pass = 0; pass < 2; ++pass)
+                for (const auto& entry : pass == 0 ? operators : bands)
+                {
+                    std::vector<int64_t> durations;
+                    int64_t total = 0;
+                    long pixels = 0, bytes = 0;
+                    for (const trace_event* e : entry.second)
+                    {
+                        durations.push_back(e->end - e->start);
+                        total += e->end - e->start;
+                        pixels += e->pixels;
+                        bytes += e->bytes;
+                    }
+                    std::sort(durations.begin(), durations.end());
+
+                    char line[256];
+                    std::string name = (pass == 0 ? "" : "band ") + entry.first;
+                    snprintf(line, sizeof(line), "%-28s %6zu %11.3f %9.3f %9.3f %9.3f %9.3f %9.3f %8.1f %7.1f",
+                             name.c_str(), durations.size(), total / 1e6, total / 1e6 / durations.size(),
+                             percentile(durations, 0.5), percentile(durations, 0.9), percentile(durations, 0.99), durations.back() / 1e6,
+                             total ? pixels * 1e3 / total : 0.0, total ? bytes * 1e3 / total : 0.0);
+                    out << line;
+                    if (pass == 1 && imbalance.count(entry.first))
+                        out << "  " << imbalance[entry.first].first / imbalance[entry.first].second;
+                    out << std::endl;
+
+                    // log2 histogram in microseconds, empty buckets skipped
+                    int buckets[64] = { 0 };
+                    for (int64_t d : durations)
+                    {
+                        int bucket = 0;
+                        for (int64_t us = d / 1000; us > 0; us >>= 1)
+                            ++bucket;
+                        buckets[bucket]++;
+                    }
+                    out << "    ";
+                    for (int i = 0; i < 64; ++i)
+                        if (buckets[i])
+                            out << " <" << (1ll << i) << "us:" << buckets[i];
+                    out << std::endl;
+                }
 
-        for (int i = 0; i <= 255; i++)
-            sum += i * ((int)hist[i]);
+            if (m_dropped)
+                out << m_dropped << " events dropped, raise trace::maximum_event_count or clear() more often" << std::endl;
+        }
+    };
 
-        for (int i = 0; i <= 255; i++)
+    // names the operator running on the calling thread, nested scopes add their pixels and bytes to the outer ones
+    class trace_scope
+    {
+    private:
+        const char* m_name;
+        int64_t m_start;
+        long m_pixels = 0, m_bytes = 0;
+        trace_scope* m_parent;
+
+        static inline trace_scope*& current()
         {
-            q1 += hist[i];
-            if (q1 == 0)
-                continue;
+            thread_local trace_scope* scope = nullptr;
+            return scope;
+        }
 
-            q2 = N - q1;
-            if (q2 == 0)
-                break;
+    public:
+        inline trace_scope(const char* name) : m_name(name), m_start(trace::now()), m_parent(current()) { current() = this; }
+        inline ~trace_scope()
+        {
+            trace::instance().record({ m_name, "operator", m_start, trace::now(), trace::thread_id(), 0, m_pixels, m_bytes });
+            current() = m_parent;
+        }
+        trace_scope(const trace_scope&) = delete;
+        trace_scope& operator=(const trace_scope&) = delete;
 
-            sumB += (float) (i * ((int)hist[i]));
-            float m1 = sumB / q1;
-            float m2 = (sum - sumB) / q2;
+        static inline const char* current_name() { return current() ? current()->m_name : "operate"; }
 
-            float varBetween = (float) q1 * (float) q2 * (m1 - m2) * (m1 - m2);
+        static inline trace_scope* detach()
+        {
+            trace_scope* scope = current();
+            current() = nullptr;
+            return scope;
+        }
+        static inline void attach(trace_scope* scope) { current() = scope; }
 
-            if (varBetween > varMax) 
+        static inline void add(long pixels, long bytes)
+        {
+            for (trace_scope* s = current(); s; s = s->m_parent)
             {
-                varMax = varBetween;
-                threshold = i;
+                s->m_pixels += pixels;
+                s->m_bytes += bytes;
             }
         }
+    };
 
-        return threshold;
-    }
+#define PPFIS_TRACE_SCOPE(name) ppfis::trace_scope ppfis_trace_scope(name)
+#else
+#define PPFIS_TRACE_SCOPE(name)
+#endif
 
-    inline void otsu_threshold(mask& m)
+    // scheduler ===
+    // Pool of worker threads shared by every task_group, so nested parallel work does not oversubscribe the cores.
+    // Each worker has its own queue, runs its newest task first and steals the oldest task of another queue when idle.
+    // Tasks of threads outside the pool go to a shared queue.
+    class scheduler
     {
-        unsigned hist[256] = {0};
-        
-        compute_hist(m, hist);
+    public:
+        // counters of a task_group: tasks not finished and tasks still in a queue
+        struct group_state
+        {
+            std::atomic<int> pending{0};
+            std::atomic<int> queued{0};
+        };
 
-        constexpr void (*func)(pixel&, int) = [](pixel& p, int threshold)
+        // func is stored as void (*)() and call casts it back to its own type before calling it
+        struct task
         {
-            if (p.r < threshold)
-                p = 0;
-            else
-                p = 255;  
+            void (*call)(void (*func)(), void* argument);
+            void (*func)();
+            void* argument;
+            group_state* group;
         };
 
-        m.operate(func, compute_otsu(m, hist));
-    }
+        template <typename T>
+        static inline void call(void (*func)(), void* argument)
+        {
+            reinterpret_cast<void (*)(T*)>(func)(static_cast<T*>(argument));
+        }
 
-    // edge detection 
-    inline void sobel_operator(mask& m)
-    {
-        void (*func)(pixels& op, pixel& np) = [](pixels& op, pixel& np)
+    private:
+        struct queue
         {
-            constexpr int filter[] = {1, 2, 1};
+            std::mutex lock;
+            std::deque<task> tasks;
+        };
 
-            int x = 0;
-            for (int row = -1; row < 2; row++)
-                for (int col = -1; col < 2; col++)
-                    x += filter[row+1] * col * op.at(row, col).r;
+        std::vector<queue*> m_queues;  // one per worker, the last one is shared
+        std::vector<std::thread> m_workers;
+        std::atomic<int> m_queued{0};
+        std::mutex m_sleep_lock;
+        std::condition_variable m_wake;      // idle workers
+        std::condition_variable m_progress;  // threads in task_group::wait, woken when a task finishes or is queued
+        int m_waiting = 0;
+        bool m_stop = false;
 
-            int y = 0;
-            for (int row = -1; row < 2; row++)
-                for (int col = -1; col < 2; col++)
-                    y += filter[col+1] * row * op.at(row, col).r;
-            
-            np = sqrt(x * x + y * y);
+        static inline int& worker_index()
+        {
+            thread_local int index = -1;
+            return index;
+        }
+
+        // the newest or oldest task of the queue, only tasks of group when it is set
+        inline bool pop(int queue_index, bool newest, const group_state* group, task& t)
+        {
+            queue& q = *m_queues[queue_index];
+            std::lock_guard<std::mutex> lock(q.lock);
+            auto belongs = [&](const task& candidate) { return !group || candidate.group == group; };
+            std::deque<task>::iterator found;
+            if (newest)
+            {
+                std::deque<task>::reverse_iterator last = std::find_if(q.tasks.rbegin(), q.tasks.rend(), belongs);
+                if (last == q.tasks.rend())
+                    return false;
+                found = std::prev(last.base());
+            }
+            else
+            {
+                found = std::find_if(q.tasks.begin(), q.tasks.end(), belongs);
+                if (found == q.tasks.end())
+                    return false;
+            }
+            t = *found;
+            q.tasks.erase(found);
+            m_queued--;
+            t.group->queued--;
+            return true;
+        }
+
+        inline void work(int index)
+        {
+            worker_index() = index;
+            while (true)
+            {
+                if (run_one())
+                    continue;
+
+                std::unique_lock<std::mutex> lock(m_sleep_lock);
+                m_wake.wait(lock, [&]{ return m_stop || m_queued > 0; });
+                if (m_stop)
+                    return;
+            }
+        }
+
+    public:
+        // worker_count threads help the threads that wait on a task_group
+        inline scheduler(int worker_count = std::max(1, int(std::thread::hardware_concurrency())) - 1)
+        {
+            for (int i = 0; i <= worker_count; ++i)
+                m_queues.push_back(new queue());
+            for (int i = 0; i < worker_count; ++i)
+                m_workers.emplace_back(&scheduler::work, this, i);
+        }
+
+        inline ~scheduler()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_sleep_lock);
+                m_stop = true;
+            }
+            m_wake.notify_all();
+            for (std::thread& w : m_workers)
+                w.join();
+            for (queue* q : m_queues)
+                delete q;
+        }
+        scheduler(const scheduler&) = delete;
+        scheduler& operator=(const scheduler&) = delete;
+
+        static inline scheduler& instance()
+        {
+            static scheduler s;
+            return s;
+        }
+
+        inline int worker_count() const { return int(m_workers.size()); }
+
+        inline void submit(const task& t)
+        {
+            int index = worker_index();
+            queue& q = *m_queues[index >= 0 ? index : m_queues.size() - 1];
+            {
+                std::lock_guard<std::mutex> lock(q.lock);
+                q.tasks.push_back(t);
+                m_queued++;
+                t.group->queued++;
+            }
+            bool waiting;
+            {
+                // taking the lock orders the push before a worker checks m_queued and sleeps
+                std::lock_guard<std::mutex> lock(m_sleep_lock);
+                waiting = m_waiting > 0;
+            }
+            m_wake.notify_one();
+            if (waiting)
+                m_progress.notify_all();
+        }
+
+        // runs one task: the newest of the own queue, then the shared queue, then the oldest of another worker.
+        // With group set only a task of that group runs.
+        inline bool run_one(const group_state* group = nullptr)
+        {
+            if ((group ? group->queued.load() : m_queued.load()) == 0)
+                return false;
+
+            const int own = worker_index(), count = int(m_queues.size());
+            task t;
+            bool found = (own >= 0 && pop(own, true, group, t)) || pop(count - 1, false, group, t);
+            const int workers = count - 1;
+            for (int i = 1; i <= workers && !found; ++i)
+            {
+                int victim = ((own >= 0 ? own : 0) + i) % workers;
+                found = victim != own && pop(victim, false, group, t);
+            }
+            if (!found)
+                return false;
+
+#ifdef PPFIS_TRACE
+            // a task run while waiting is not part of the operator that waits
+            trace_scope* scope = trace_scope::detach();
+            t.call(t.func, t.argument);
+            trace_scope::attach(scope);
+#else
+            t.call(t.func, t.argument);
+#endif
+            if (t.group->pending.fetch_sub(1, std::memory_order_release) == 1)
+            {
+                bool waiting;
+                {
+                    std::lock_guard<std::mutex> lock(m_sleep_lock);
+                    waiting = m_waiting > 0;
+                }
+                if (waiting)
+                    m_progress.notify_all();
+            }
+            return true;
+        }
+
+        // blocks until every task of group finished or one is queued, for a waiter that found nothing to run
+        inline void sleep(const group_state& group)
+        {
+            std::unique_lock<std::mutex> lock(m_sleep_lock);
+            ++m_waiting;
+            m_progress.wait(lock, [&]{ return group.pending.load(std::memory_order_acquire) == 0 || group.queued > 0; });
+            --m_waiting;
+        }
+    };
+
+    // Tasks that are waited for together. wait runs the queued tasks of this group while it is unfinished,
+    // so a task may start and wait for a group of its own without blocking a worker. With nothing to run it sleeps.
+    // Tasks of other groups are left to the workers: a waiter would otherwise pick up an unrelated long task,
+    // e.g. another ROI, and return that much later.
+    class task_group
+    {
+    private:
+        scheduler::group_state m_state;
+        scheduler& m_scheduler;
+
+    public:
+        inline task_group(scheduler& s = scheduler::instance()) : m_scheduler(s) {}
+        inline ~task_group() { wait(); }
+        task_group(const task_group&) = delete;
+        task_group& operator=(const task_group&) = delete;
+
+        template <typename T>
+        inline void run(void (*func)(T*), T* argument)
+        {
+            m_state.pending.fetch_add(1, std::memory_order_relaxed);
+            m_scheduler.submit({ &scheduler::call<T>, reinterpret_cast<void (*)()>(func), argument, &m_state });
+        }
+
+        inline void run(void (*func)(void*), void* argument) { run<void>(func, argument); }
+
+        inline void wait()
+        {
+            while (m_state.pending.load(std::memory_order_acquire) > 0)
+                if (!m_scheduler.run_one(&m_state))
+                    m_scheduler.sleep(m_state);
+        }
+    };
+
+    // Calls func(i, argument) for every i in [begin, end), cut into chunk_count chunks of consecutive indices.
+    // The chunks go to the shared scheduler, the calling thread runs the last one and helps with the rest while waiting.
+    template <typename T>
+    inline void parallel_for(int begin, int end, int chunk_count, void (*func)(int, T*), T* argument)
+    {
+        struct chunk
+        {
+            void (*func)(int, T*);
+            T* argument;
+            int first, last;
+        };
+        void (*run_chunk)(chunk*) = [](chunk* c)
+        {
+            for (int i = c->first; i < c->last; ++i)
+                c->func(i, c->argument);
+        };
+
+        chunk_count = std::max(1, std::min(chunk_count, end - begin));
+        if (chunk_count == 1)
+        {
+            chunk all = { func, argument, begin, end };
+            run_chunk(&all);
+            return;
+        }
+
+        std::vector<chunk> chunks(chunk_count);
+        for (int i = 0; i < chunk_count; ++i)
+            chunks[i] = { func, argument, begin + int(int64_t(end - begin) * i / chunk_count), begin + int(int64_t(end - begin) * (i + 1) / chunk_count) };
+
+        task_group group;
+        for (int i = 0; i < chunk_count - 1; ++i)
+            group.run(run_chunk, &chunks[i]);
+        run_chunk(&chunks[chunk_count - 1]);
+        group.wait();
+    }
+
+    // band is the horizontal slice of a mask handed to one thread.
+    // source is a snapshot taken before the operation, destination is the image itself.
+    // Only [left, right) x [top, bottom) should be written, but the whole source may be read.
+    // scratch is private to the band and rewound when the band finishes.
+    struct band
+    {
+        const uchar* source;
+        uchar* destination;
+        int image_width, image_height, channels;
+        int left, right, top, bottom;
+        scratch_arena* scratch;
+    };
+
+    class pixels;
+    class row_pixels;
+
+    class mask
+    {
+    private:
+        constexpr static int m_mask_maximum_thread = 8;
+        int m_thread_count = 0;
+
+        uchar** m_image_ptr = nullptr;
+        int m_image_width = -1, m_image_height = -1;
+        int m_channels = 3;
+
+        template <typename ... parameters>
+        struct per_pixel_operation
+        {
+            pixel* image;
+            int image_width;
+            void (*per_pixel_func)(pixel&, parameters ...);
+            int left, right;
+            std::tuple<parameters...> params;
+        };
+
+        template <typename ... parameters>
+        struct per_neighbourhood_operation
+        {
+            mask* m;
+            pixel* new_image;
+            void (*per_pixel_func)(pixels&, pixel&, parameters ...);
+            int left, right;
+            std::tuple<parameters...> params;
+        };
+
+        template <typename ... parameters>
+        struct per_band_operation
+        {
+            band b;
+            void (*per_band_func)(const band&, parameters ...);
+            std::tuple<parameters...> params;
+        };
+
+        // rows [top, bottom) of one operation, run on its own thread or on the calling thread
+        struct band_job
+        {
+            void (*func)(void* operation, int top, int bottom, scratch_arena& scratch);
+            void* operation;
+            int top, bottom;
+            scratch_arena* scratch;
+#ifdef PPFIS_TRACE
+            const char* name;
+            long call;
+            long pixels, bytes;
+#endif
+        };
+
+        template <typename ... parameters>
+        static void operate_per_pixel_thread(void* operation, int top, int bottom, scratch_arena& scratch);
+        template <typename ... parameters>
+        static void operate_per_neighbourhood_thread(void* operation, int top, int bottom, scratch_arena& scratch);
+        template <typename ... parameters>
+        static void operate_per_band_thread(void* operation, int top, int bottom, scratch_arena& scratch);
+        static void run_band_job(band_job* job);
+
+        // run_bands calls in progress on this thread, selects the band arenas
+        static inline int& band_depth()
+        {
+            thread_local int depth = 0;
+            return depth;
+        }
+
+        // splits [top, bottom) into m_thread_count + 1 bands on the shared scheduler, the calling thread takes the last band
+        void run_bands(int left, int right, int top, int bottom, void (*func)(void*, int, int, scratch_arena&), void* operation, int bytes_per_pixel);
+
+        friend pixels;
+        friend row_pixels;
+    public:
+        int border_left = 0;
+        int border_top = 0;
+        int border_right = 0;
+        int border_bottom = 0;
+
+        inline int get_thread_count(void) { return m_thread_count; }
+        inline void set_thread_count(int thread_count) { m_thread_count = std::max(0, std::min(m_mask_maximum_thread, thread_count));}
+        inline int get_channels(void) { return m_channels; }
+        inline const uchar* get_image(void) { return m_image_ptr ? *m_image_ptr : nullptr; }
+        inline int get_image_width(void) { return m_image_width; }
+        inline int get_image_height(void) { return m_image_height; }
+
+        // channels is either 3 (CV_8UC3) or 1 (CV_8UC1).
+        // Per pixel operations work on 3 channels only, per band operations work on both.
+        mask(uchar** image_ptr, int image_width, int image_height, int channels = 3);
+        void set_border(int left, int top, int right, int bottom);
+        void set_relative_border(int d_left, int d_top, int d_right, int d_bottom);
+
+        template <typename ... parameters>
+        bool operate(void (*per_pixel_func)(pixel& current_pixel, parameters ... params), parameters ... params);
+        template <typename ... parameters>
+        bool operate(void (*per_pixel_func)(pixels& original_pixel, pixel& output_pixel, parameters ... params), parameters ... params);
+        template <typename ... parameters>
+        bool operate(void (*per_band_func)(const band& b, parameters ... params), parameters ... params);
+        // no snapshot, source and destination are both the image, for point operations and passes that only read
+        template <typename ... parameters>
+        bool operate_in_place(void (*per_band_func)(const band& b, parameters ... params), parameters ... params);
+    };
+
+    class row_pixels
+    {
+    private:
+        const mask* m_mask_ptr;
+        int m_current_row;
+        int m_current_column;
+    
+        inline row_pixels(int current_row, int current_column, const mask* mask_ptr) : m_current_row(current_row), m_current_column(current_column), m_mask_ptr(mask_ptr) {}
+        
+        friend pixels;
+
+    public:
+        inline const pixel& operator[](int relative_column)
+        {
+            int row = std::max(0,std::min(m_mask_ptr->m_image_width, m_current_row));
+            int column = std::max(0,std::min(m_mask_ptr->m_image_height, m_current_column + relative_column));
+            return reinterpret_cast<pixel*>(*m_mask_ptr->m_image_ptr)[column * m_mask_ptr->m_image_width + row];
+        }
+    };
+
+    class pixels
+    {
+    private:
+        const mask* m_mask_ptr;
+        int m_current_row;
+        int m_current_column;
+
+        inline pixels() {}
+
+        friend mask;
+    public:
+        inline const pixel& at(int relative_row, int relative_column)
+        {
+            int row = std::max(0,std::min(m_mask_ptr->m_image_width, m_current_row + relative_row));
+            int column = std::max(0,std::min(m_mask_ptr->m_image_height, m_current_column + relative_column));
+            return reinterpret_cast<pixel*>(*m_mask_ptr->m_image_ptr)[column * m_mask_ptr->m_image_width + row];
+        }
+
+        inline row_pixels operator[](int relative_row) const { return row_pixels(m_current_row + relative_row, m_current_column, m_mask_ptr); }
+    };
+
+    template <typename ... parameters>
+    inline void mask::operate_per_pixel_thread(void* operation, int top, int bottom, scratch_arena&)
+    {
+        per_pixel_operation<parameters...>& o = *reinterpret_cast<per_pixel_operation<parameters...>*>(operation);
+        std::apply([&](const parameters& ... params)
+        {
+            for (int c = top; c < bottom; ++c)
+                for (int r = o.left; r < o.right; ++r)
+                    o.per_pixel_func(o.image[c * o.image_width + r], params...);
+        }, o.params);
+    }
+
+    template <typename ... parameters>
+    inline void mask::operate_per_neighbourhood_thread(void* operation, int top, int bottom, scratch_arena&)
+    {
+        per_neighbourhood_operation<parameters...>& o = *reinterpret_cast<per_neighbourhood_operation<parameters...>*>(operation);
+        std::apply([&](const parameters& ... params)
+        {
+            pixels op;
+            op.m_mask_ptr = o.m;
+            for (int c = top; c < bottom; ++c)
+                for (int r = o.left; r < o.right; ++r)
+                {
+                    op.m_current_column = c;
+                    op.m_current_row = r;
+                    o.per_pixel_func(op, o.new_image[c * o.m->m_image_width + r], params...);
+                }
+        }, o.params);
+    }
+
+    template <typename ... parameters>
+    inline void mask::operate_per_band_thread(void* operation, int top, int bottom, scratch_arena& scratch)
+    {
+        per_band_operation<parameters...>& o = *reinterpret_cast<per_band_operation<parameters...>*>(operation);
+        band b = o.b;
+        b.top = top;
+        b.bottom = bottom;
+        b.scratch = &scratch;
+        std::apply([&](const parameters& ... params) { o.per_band_func(b, params...); }, o.params);
+    }
+
+    inline mask::mask(uchar** image_ptr, int image_width, int image_height, int channels) : m_image_ptr(image_ptr), m_image_width(image_height), m_image_height(image_width), m_channels(channels)
+    {
+        border_left = 0;
+        border_top = 0;
+        border_right = image_height;
+        border_bottom = image_width;
+    }
+
+    inline void mask::set_border(int left, int top, int right, int bottom)
+    {
+        border_left = left;
+        border_top = top;
+        border_right = right;
+        border_bottom = bottom;
+    }
+
+    inline void mask::set_relative_border(int d_left, int d_top, int d_right, int d_bottom)
+    {
+        border_left = 0 + d_left;
+        border_top = 0 + d_top;
+        border_right = m_image_width - d_right;
+        border_bottom = m_image_height - d_bottom;
+    }
+
+    inline void mask::run_band_job(band_job* job)
+    {
+        // band functions may run on any pool thread, local() is the band arena while they run
+        scratch_binding binding(*job->scratch);
+        scratch_scope scope(*job->scratch);
+#ifdef PPFIS_TRACE
+        int64_t start = trace::now();
+        job->func(job->operation, job->top, job->bottom, *job->scratch);
+        trace::instance().record({ job->name, "band", start, trace::now(), trace::thread_id(), job->call, job->pixels, job->bytes });
+#else
+        job->func(job->operation, job->top, job->bottom, *job->scratch);
+#endif
+    }
+
+    inline void mask::run_bands(int left, int right, int top, int bottom, void (*func)(void*, int, int, scratch_arena&), void* operation, int bytes_per_pixel)
+    {
+        band_job jobs[m_mask_maximum_thread + 1];
+
+        // estimate thread count
+        int concurrent_operation_count = bottom - top > m_thread_count + 1 ? m_thread_count + 1 : 1;
+        int height_per_thread = (bottom - top) / concurrent_operation_count;
+        const int depth = band_depth();
+
+#ifdef PPFIS_TRACE
+        const char* name = trace_scope::current_name();
+        long call = trace::next_call();
+        trace_scope::add(long(right - left) * (bottom - top), long(right - left) * (bottom - top) * bytes_per_pixel);
+#else
+        // the band width is only traced
+        (void)left;
+        (void)right;
+        (void)bytes_per_pixel;
+#endif
+
+        for (int i = 0; i < concurrent_operation_count; ++i)
+        {
+            band_job& job = jobs[i];
+            job.func = func;
+            job.operation = operation;
+            job.top = top + height_per_thread * i;
+            job.bottom = i == concurrent_operation_count - 1 ? bottom : top + height_per_thread * (i + 1);
+            job.scratch = &scratch_arena::local().band(depth, i);
+#ifdef PPFIS_TRACE
+            job.name = name;
+            job.call = call;
+            job.pixels = long(right - left) * (job.bottom - job.top);
+            job.bytes = job.pixels * bytes_per_pixel;
+#endif
+        }
+
+        // bands go to the shared pool, the calling thread runs the last one and helps with the rest while waiting
+        ++band_depth();
+        if (concurrent_operation_count == 1)
+            run_band_job(&jobs[0]);
+        else
+        {
+            task_group group;
+            for (int i = 0; i < concurrent_operation_count - 1; ++i)
+                group.run(mask::run_band_job, &jobs[i]);
+            run_band_job(&jobs[concurrent_operation_count - 1]);
+            group.wait();
+        }
+        --band_depth();
+    }
+
+    template <typename ... parameters>
+    inline bool mask::operate(void (*per_pixel_func)(pixel& current_pixel, parameters ... params), parameters ... params)
+    {
+        if (!m_image_ptr || !per_pixel_func || m_channels != 3) return false;
+
+        // map ranges due to borders
+        int right = std::min(std::max(border_left, border_right), m_image_width);
+        int left = std::max(std::min(border_left, right), 0);
+        int bottom = std::min(std::max(border_top, border_bottom), m_image_height);
+        int top = std::max(std::min(border_top, bottom), 0);
+
+        per_pixel_operation<parameters...> operation = { reinterpret_cast<pixel*>(*m_image_ptr), m_image_width, per_pixel_func, left, right, std::make_tuple(params...) };
+
+        // read and write every pixel in place
+        run_bands(left, right, top, bottom, operate_per_pixel_thread<parameters...>, &operation, 3 * 2);
+        return true;
+    }
+
+    template <typename ... parameters>
+    inline bool mask::operate(void (*per_pixel_func)(pixels& original_pixel, pixel& output_pixel, parameters ... params), parameters ... params)
+    {
+        if (!m_image_ptr || !per_pixel_func || m_channels != 3) return false;
+
+        // create new image
+        scratch_scope scope;
+        pixel* new_image = scratch_arena::local().allocate_array<pixel>(m_image_width * m_image_height);
+        memcpy(new_image, *m_image_ptr, m_image_width * m_image_height * 3);
+
+        // map ranges due to borders
+        int right = std::min(std::max(border_left, border_right), m_image_width);
+        int left = std::max(std::min(border_left, right), 0);
+        int bottom = std::min(std::max(border_top, border_bottom), m_image_height);
+        int top = std::max(std::min(border_top, bottom), 0);
+
+        per_neighbourhood_operation<parameters...> operation = { this, new_image, per_pixel_func, left, right, std::make_tuple(params...) };
+
+        // read the neighbourhood from the image, write the new image
+        run_bands(left, right, top, bottom, operate_per_neighbourhood_thread<parameters...>, &operation, 3 * 2);
+
+        // copy result
+        memcpy(*m_image_ptr, new_image, m_image_width * m_image_height * 3);
+        return true;
+    }
+
+    template <typename ... parameters>
+    inline bool mask::operate(void (*per_band_func)(const band& b, parameters ... params), parameters ... params)
+    {
+        if (!m_image_ptr || !per_band_func) return false;
+
+        // snapshot the image, bands write straight into it
+        size_t image_size = size_t(m_image_width) * m_image_height * m_channels;
+        scratch_scope scope;
+        uchar* source = scratch_arena::local().allocate_array<uchar>(image_size);
+        memcpy(source, *m_image_ptr, image_size);
+
+        // map ranges due to borders
+        int right = std::min(std::max(border_left, border_right), m_image_width);
+        int left = std::max(std::min(border_left, right), 0);
+        int bottom = std::min(std::max(border_top, border_bottom), m_image_height);
+        int top = std::max(std::min(border_top, bottom), 0);
+
+        per_band_operation<parameters...> operation = { { source, *m_image_ptr, m_image_width, m_image_height, m_channels, left, right, top, bottom, nullptr }, per_band_func, std::make_tuple(params...) };
+
+        // read the snapshot, write the image
+        run_bands(left, right, top, bottom, operate_per_band_thread<parameters...>, &operation, m_channels * 2);
+        return true;
+    }
+
+    template <typename ... parameters>
+    inline bool mask::operate_in_place(void (*per_band_func)(const band& b, parameters ... params), parameters ... params)
+    {
+        if (!m_image_ptr || !per_band_func) return false;
+
+        // map ranges due to borders
+        int right = std::min(std::max(border_left, border_right), m_image_width);
+        int left = std::max(std::min(border_left, right), 0);
+        int bottom = std::min(std::max(border_top, border_bottom), m_image_height);
+        int top = std::max(std::min(border_top, bottom), 0);
+
+        per_band_operation<parameters...> operation = { { *m_image_ptr, *m_image_ptr, m_image_width, m_image_height, m_channels, left, right, top, bottom, nullptr }, per_band_func, std::make_tuple(params...) };
+
+        run_bands(left, right, top, bottom, operate_per_band_thread<parameters...>, &operation, m_channels * 2);
+        return true;
+    }
+
+    inline void grayscale(mask& m)
+    {
+        PPFIS_TRACE_SCOPE("grayscale");
+
+        void (*func)(pixel& p) = [](pixel& p)
+        {
+            uchar gray = uchar((int(p.r) + int(p.g) + int(p.b))/3);
+            p = gray;
+        };
+
+        m.operate(func);
+    }
+
+    // threshold
+    inline void threshold(mask& m, int threshold)
+    {
+        PPFIS_TRACE_SCOPE("threshold");
+
+        grayscale(m);
+
+        constexpr void (*func)(pixel&, int) = [](pixel& p, int threshold)
+        {
+            if (p.r < threshold)
+                p = 0;
+            else
+                p = 255; 
+        };
+
+        m.operate(func, threshold);
+    }
+    
+    // histogram of the r channel (the gray value after grayscale) or of the single channel
+    struct histogram
+    {
+        uint32_t bins[256] = {0};
+        uint64_t total = 0;
+
+        inline void clear()
+        {
+            memset(bins, 0, sizeof(bins));
+            total = 0;
+        }
+
+        inline void add(const histogram& h)
+        {
+            for (int i = 0; i < 256; ++i)
+                bins[i] += h.bins[i];
+            total += h.total;
+        }
+
+        inline void remove(const histogram& h)
+        {
+            for (int i = 0; i < 256; ++i)
+                bins[i] -= h.bins[i];
+            total -= h.total;
+        }
+
+        // counts [left, right) x [top, bottom) of an image
+        inline void count(const uchar* image, int image_width, int channels, int left, int right, int top, int bottom)
+        {
+            const int offset = channels == 3 ? 2 : 0;
+            for (int y = top; y < bottom; ++y)
+            {
+                const uchar* row = image + (size_t(y) * image_width + left) * channels + offset;
+                for (int x = 0; x < right - left; ++x)
+                    bins[row[x * channels]]++;
+            }
+            total += uint64_t(right - left) * std::max(0, bottom - top);
+        }
+
+        // counts the mask inside its borders, one histogram per band merged at the end
+        inline void compute(mask& m);
+    };
+
+    struct histogram_merge
+    {
+        histogram* target;
+        std::mutex lock;
+    };
+
+    inline void histogram_band(const band& b, histogram_merge* merge)
+    {
+        histogram h;
+        h.count(b.source, b.image_width, b.channels, b.left, b.right, b.top, b.bottom);
+
+        std::lock_guard<std::mutex> guard(merge->lock);
+        merge->target->add(h);
+    }
+
+    inline void histogram::compute(mask& m)
+    {
+        clear();
+        histogram_merge merge;
+        merge.target = this;
+
+        void (*func)(const band&, histogram_merge*) = histogram_band;
+        m.operate_in_place(func, &merge);
+    }
+
+    inline void compute_hist(mask& m, unsigned* hist)
+    {
+        PPFIS_TRACE_SCOPE("compute_hist");
+
+        histogram h;
+        h.compute(m);
+        for (int i = 0; i < 256; ++i)
+            hist[i] += h.bins[i];
+    }
+
+    // Otsu threshold, the last bin of the lower class: values below it become 0 in otsu_threshold.
+    // N is the number of counted pixels, so clamped borders do not skew it.
+    inline int otsu(const histogram& h)
+    {
+        double sum = 0;
+        for (int i = 0; i <= 255; i++)
+            sum += double(i) * h.bins[i];
+
+        int threshold = 0;
+        double sumB = 0;
+        uint64_t q1 = 0;
+        double varMax = 0;
+
+        for (int i = 0; i <= 255; i++)
+        {
+            q1 += h.bins[i];
+            if (q1 == 0)
+                continue;
+
+            uint64_t q2 = h.total - q1;
+            if (q2 == 0)
+                break;
+
+            sumB += double(i) * h.bins[i];
+            double m1 = sumB / q1;
+            double m2 = (sum - sumB) / q2;
+
+            double varBetween = double(q1) * double(q2) * (m1 - m2) * (m1 - m2);
+
+            if (varBetween > varMax)
+            {
+                varMax = varBetween;
+                threshold = i;
+            }
+        }
+
+        return threshold;
+    }
+
+    // Multi level Otsu, splits the histogram into count + 1 classes maximising the between class variance.
+    // thresholds[i] is the last bin of class i like otsu, so multi_otsu with count 1 equals otsu.
+    // Dynamic programming over class boundaries, O(count * 256^2).
+    inline void multi_otsu(const histogram& h, int* thresholds, int count)
+    {
+        count = std::max(1, std::min(254, count));
+
+        // prefix weight and sum, bins [0, j) are p[j]
+        double weight[257] = {0}, sum[257] = {0};
+        for (int i = 0; i < 256; ++i)
+        {
+            weight[i + 1] = weight[i] + h.bins[i];
+            sum[i + 1] = sum[i] + double(i) * h.bins[i];
+        }
+
+        // between class variance up to a constant: sum over classes of sum^2 / weight
+        auto cost = [&](int from, int to)
+        {
+            double w = weight[to] - weight[from];
+            double s = sum[to] - sum[from];
+            return w > 0 ? s * s / w : 0.0;
+        };
+
+        // best[c][j]: bins [0, j) split into c + 1 classes, split[c][j] is where the last class starts
+        std::vector<double> best(size_t(count + 1) * 257, -1.0);
+        std::vector<int> split(size_t(count + 1) * 257, 0);
+        for (int j = 1; j <= 256; ++j)
+            best[j] = cost(0, j);
+
+        for (int c = 1; c <= count; ++c)
+            for (int j = c + 1; j <= 256; ++j)
+            {
+                double& b = best[size_t(c) * 257 + j];
+                for (int i = c; i < j; ++i)
+                {
+                    double previous = best[size_t(c - 1) * 257 + i];
+                    if (previous < 0)
+                        continue;
+                    double v = previous + cost(i, j);
+                    if (v > b)
+                    {
+                        b = v;
+                        split[size_t(c) * 257 + j] = i;
+                    }
+                }
+            }
+
+        int j = 256;
+        for (int c = count; c >= 1; --c)
+        {
+            j = split[size_t(c) * 257 + j];
+            thresholds[c - 1] = j - 1;
+        }
+    }
+
+    inline int compute_otsu(mask&, unsigned *hist)
+    {
+        histogram h;
+        for (int i = 0; i < 256; ++i)
+        {
+            h.bins[i] = hist[i];
+            h.total += hist[i];
+        }
+        return otsu(h);
+    }
+
+    // Histogram of consecutive frames kept per tile, only tiles that changed since the last update are recounted.
+    // Changes are found by comparing against the previous frame, or given as a rectangle by the caller.
+    class tiled_histogram
+    {
+    private:
+        int m_tile_size;
+        int m_width = 0, m_height = 0, m_tiles_x = 0, m_tiles_y = 0;
+        std::vector<histogram> m_tiles;
+        std::vector<uchar> m_previous;
+        std::vector<uchar> m_dirty;
+        histogram m_total;
+        std::mutex m_lock;
+        int m_recounted = 0;
+
+        // every band handles the tile rows starting inside it, rows below the band are only read
+        static inline void update_band(const band& b, tiled_histogram* t, bool compare)
+        {
+            const int ts = t->m_tile_size, w = b.image_width, h = b.image_height, ch = b.channels;
+            const int offset = ch == 3 ? 2 : 0;
+
+            int64_t delta[256] = {0};
+            uint64_t delta_total = 0;
+            int recounted = 0;
+
+            for (int ty = (b.top + ts - 1) / ts; ty * ts < b.bottom; ++ty)
+                for (int tx = 0; tx < t->m_tiles_x; ++tx)
+                {
+                    int x0 = tx * ts, x1 = std::min(w, x0 + ts);
+                    int y0 = ty * ts, y1 = std::min(h, y0 + ts);
+                    size_t index = size_t(ty) * t->m_tiles_x + tx;
+
+                    bool changed = t->m_dirty[index] != 0;
+                    for (int y = y0; y < y1 && compare && !changed; ++y)
+                    {
+                        const uchar* in = b.source + (size_t(y) * w + x0) * ch + offset;
+                        const uchar* previous = t->m_previous.data() + size_t(y) * w + x0;
+                        for (int x = 0; x < x1 - x0; ++x)
+                            if (in[x * ch] != previous[x])
+                            {
+                                changed = true;
+                                break;
+                            }
+                    }
+                    if (!changed)
+                        continue;
+
+                    histogram& tile = t->m_tiles[index];
+                    for (int i = 0; i < 256; ++i)
+                        delta[i] -= tile.bins[i];
+                    delta_total -= tile.total;
+
+                    tile.clear();
+                    tile.count(b.source, w, ch, x0, x1, y0, y1);
+                    for (int i = 0; i < 256; ++i)
+                        delta[i] += tile.bins[i];
+                    delta_total += tile.total;
+
+                    for (int y = y0; y < y1; ++y)
+                    {
+                        const uchar* in = b.source + (size_t(y) * w + x0) * ch + offset;
+                        uchar* previous = t->m_previous.data() + size_t(y) * w + x0;
+                        for (int x = 0; x < x1 - x0; ++x)
+                            previous[x] = in[x * ch];
+                    }
+
+                    t->m_dirty[index] = 0;
+                    ++recounted;
+                }
+
+            std::lock_guard<std::mutex> guard(t->m_lock);
+            for (int i = 0; i < 256; ++i)
+                t->m_total.bins[i] += uint32_t(delta[i]);
+            t->m_total.total += delta_total;
+            t->m_recounted += recounted;
+        }
+
+        inline int run(mask& m, bool compare)
+        {
+            int left = m.border_left, top = m.border_top, right = m.border_right, bottom = m.border_bottom;
+            m.set_relative_border(0, 0, 0, 0);
+
+            // a new size starts over
+            if (m.border_right != m_width || m.border_bottom != m_height)
+            {
+                m_width = m.border_right;
+                m_height = m.border_bottom;
+                m_tiles_x = (m_width + m_tile_size - 1) / m_tile_size;
+                m_tiles_y = (m_height + m_tile_size - 1) / m_tile_size;
+                m_tiles.assign(size_t(m_tiles_x) * m_tiles_y, histogram());
+                m_dirty.assign(m_tiles.size(), 1);
+                m_previous.assign(size_t(m_width) * m_height, 0);
+                m_total.clear();
+            }
+
+            m_recounted = 0;
+            void (*func)(const band&, tiled_histogram*, bool) = update_band;
+            m.operate_in_place(func, this, compare);
+
+            m.set_border(left, top, right, bottom);
+            return m_recounted;
+        }
+
+    public:
+        inline tiled_histogram(int tile_size = 64) : m_tile_size(std::max(1, tile_size)) {}
+
+        // compares every tile with the previous frame, returns the number of recounted tiles
+        inline int update(mask& m)
+        {
+            return run(m, true);
+        }
+
+        // recounts only the tiles overlapping [left, right) x [top, bottom), nothing else is read
+        inline int update(mask& m, int left, int top, int right, int bottom)
+        {
+            if (m_width == 0)
+                return update(m);
+
+            for (int ty = std::max(0, top / m_tile_size); ty < m_tiles_y && ty * m_tile_size < bottom; ++ty)
+                for (int tx = std::max(0, left / m_tile_size); tx < m_tiles_x && tx * m_tile_size < right; ++tx)
+                    m_dirty[size_t(ty) * m_tiles_x + tx] = 1;
+            return run(m, false);
+        }
+
+        inline const histogram& get() const { return m_total; }
+    };
+
+    // maps the r channel (or the single channel) through table and writes the result to every channel
+    inline void table_band(const band& b, const uchar* table)
+    {
+        const int w = b.image_width, ch = b.channels;
+        const int offset = ch == 3 ? 2 : 0;
+        for (int y = b.top; y < b.bottom; ++y)
+        {
+            uchar* row = b.destination + (size_t(y) * w + b.left) * ch;
+            for (int x = 0; x < b.right - b.left; ++x)
+            {
+                uchar v = table[row[x * ch + offset]];
+                for (int c = 0; c < ch; ++c)
+                    row[x * ch + c] = v;
+            }
+        }
+    }
+
+    // reuses a histogram that is already known, e.g. from tiled_histogram
+    inline void otsu_threshold(mask& m, const histogram& h)
+    {
+        PPFIS_TRACE_SCOPE("otsu_threshold");
+
+        int threshold = otsu(h);
+        uchar table[256];
+        for (int i = 0; i < 256; ++i)
+            table[i] = i < threshold ? 0 : 255;
+
+        void (*func)(const band&, const uchar*) = table_band;
+        m.operate_in_place(func, const_cast<const uchar*>(table));
+    }
+
+    inline void otsu_threshold(mask& m)
+    {
+        PPFIS_TRACE_SCOPE("otsu_threshold");
+
+        histogram h;
+        h.compute(m);
+
+        otsu_threshold(m, h);
+    }
+
+    // count thresholds, count + 1 output levels evenly spread over 0 - 255
+    inline void multi_otsu_threshold(mask& m, const histogram& h, int count)
+    {
+        PPFIS_TRACE_SCOPE("multi_otsu_threshold");
+
+        count = std::max(1, std::min(254, count));
+        std::vector<int> thresholds(count);
+        multi_otsu(h, thresholds.data(), count);
+
+        uchar table[256];
+        for (int i = 0, level = 0; i < 256; ++i)
+        {
+            // values below a threshold stay in the lower class, as in otsu_threshold
+            while (level < count && i >= thresholds[level])
+                ++level;
+            table[i] = uchar(level * 255 / count);
+        }
+
+        void (*func)(const band&, const uchar*) = table_band;
+        m.operate_in_place(func, const_cast<const uchar*>(table));
+    }
+
+    inline void multi_otsu_threshold(mask& m, int count)
+    {
+        histogram h;
+        h.compute(m);
+
+        multi_otsu_threshold(m, h, count);
+    }
+
+    // windowed statistics ===
+    // Integral images of the gray value and of its square, (r + g + b) / 3 for 3 channels.
+    // Sums are kept modulo 2^32, which is exact for every window whose true sum fits: up to 256 x 256 pixels.
+    class window_statistics
+    {
+    private:
+        uint32_t* m_sum = nullptr;
+        uint32_t* m_square_sum = nullptr;
+        int m_width = 0, m_height = 0;
+
+        // 1 + band index on the first row of every band, 0 elsewhere
+        uchar* m_band_starts = nullptr;
+        // running totals of all bands above, per band
+        uint32_t* m_carry = nullptr;
+
+        // rows of each band are summed as if the band started the image
+        static inline void prefix_band(const band& b, window_statistics* s)
+        {
+            const int w = b.image_width, ch = b.channels, stride = w + 1;
+            s->m_band_starts[b.top] = 1;
+
+            for (int y = b.top; y < b.bottom; ++y)
+            {
+                const uchar* in = b.source + size_t(y) * w * ch;
+                uint32_t* sum = s->m_sum + size_t(y + 1) * stride;
+                uint32_t* square_sum = s->m_square_sum + size_t(y + 1) * stride;
+                const uint32_t* sum_above = y == b.top ? nullptr : sum - stride;
+                const uint32_t* square_sum_above = y == b.top ? nullptr : square_sum - stride;
+
+                uint32_t row_sum = 0, row_square_sum = 0;
+                sum[0] = square_sum[0] = 0;
+                for (int x = 0; x < w; ++x)
+                {
+                    uint32_t v = ch == 3 ? (uint32_t(in[x * 3]) + in[x * 3 + 1] + in[x * 3 + 2]) / 3 : in[x];
+                    row_sum += v;
+                    row_square_sum += v * v;
+                    sum[x + 1] = row_sum + (sum_above ? sum_above[x + 1] : 0);
+                    square_sum[x + 1] = row_square_sum + (square_sum_above ? square_sum_above[x + 1] : 0);
+                }
+            }
+        }
+
+        static inline void carry_band(const band& b, window_statistics* s)
+        {
+            int index = s->m_band_starts[b.top] - 1;
+            if (index <= 0)
+                return;
+
+            const int stride = s->m_width + 1;
+            const uint32_t* __restrict carry_sum = s->m_carry + size_t(index) * stride * 2;
+            const uint32_t* __restrict carry_square_sum = carry_sum + stride;
+            for (int y = b.top; y < b.bottom; ++y)
+            {
+                uint32_t* __restrict sum = s->m_sum + size_t(y + 1) * stride;
+                uint32_t* __restrict square_sum = s->m_square_sum + size_t(y + 1) * stride;
+                for (int x = 0; x < stride; ++x)
+                {
+                    sum[x] += carry_sum[x];
+                    square_sum[x] += carry_square_sum[x];
+                }
+            }
+        }
+
+    public:
+        constexpr static int maximum_window = 255;
+
+        // builds over the whole image regardless of the mask borders, memory is drawn from arena
+        inline bool build(mask& m, scratch_arena& arena = scratch_arena::local())
+        {
+            int left = m.border_left, top = m.border_top, right = m.border_right, bottom = m.border_bottom;
+            m.set_relative_border(0, 0, 0, 0);
+            m_width = m.border_right;
+            m_height = m.border_bottom;
+            if (m_width <= 0 || m_height <= 0)
+            {
+                m.set_border(left, top, right, bottom);
+                return false;
+            }
+
+            const int stride = m_width + 1;
+            m_sum = arena.allocate_array<uint32_t>(size_t(stride) * (m_height + 1));
+            m_square_sum = arena.allocate_array<uint32_t>(size_t(stride) * (m_height + 1));
+            m_band_starts = arena.allocate_array<uchar>(m_height);
+            memset(m_sum, 0, sizeof(uint32_t) * stride);
+            memset(m_square_sum, 0, sizeof(uint32_t) * stride);
+            memset(m_band_starts, 0, m_height);
+
+            void (*prefix)(const band&, window_statistics*) = prefix_band;
+            m.operate_in_place(prefix, this);
+
+            // the last row of every band, summed from the top, is carried into the band below
+            int band_count = 0;
+            for (int y = 0; y < m_height; ++y)
+                band_count += m_band_starts[y] ? 1 : 0;
+            m_carry = arena.allocate_array<uint32_t>(size_t(band_count) * stride * 2);
+            memset(m_carry, 0, sizeof(uint32_t) * stride * 2);
+
+            for (int y = 0, index = 0; y < m_height; ++y)
+            {
+                if (!m_band_starts[y])
+                    continue;
+                m_band_starts[y] = uchar(++index);
+                if (index == 1)
+                    continue;
+
+                uint32_t* carry = m_carry + size_t(index - 1) * stride * 2;
+                const uint32_t* previous = carry - stride * 2;
+                for (int x = 0; x < stride; ++x)
+                {
+                    carry[x] = previous[x] + m_sum[size_t(y) * stride + x];
+                    carry[stride + x] = previous[stride + x] + m_square_sum[size_t(y) * stride + x];
+                }
+            }
+
+            void (*carry)(const band&, window_statistics*) = carry_band;
+            m.operate_in_place(carry, this);
+
+            m.set_border(left, top, right, bottom);
+            return true;
+        }
+
+        inline int width() const { return m_width; }
+        inline int height() const { return m_height; }
+
+        // sums over [x0, x1) x [y0, y1), the range must lie inside the image
+        inline void sums(int x0, int y0, int x1, int y1, uint32_t& sum, uint32_t& square_sum) const
+        {
+            const size_t stride = m_width + 1;
+            sum = m_sum[y1 * stride + x1] - m_sum[y0 * stride + x1] - m_sum[y1 * stride + x0] + m_sum[y0 * stride + x0];
+            square_sum = m_square_sum[y1 * stride + x1] - m_square_sum[y0 * stride + x1] - m_square_sum[y1 * stride + x0] + m_square_sum[y0 * stride + x0];
+        }
+    };
+
+    enum class local_threshold
+    {
+        mean_c,   // mean - C
+        niblack,  // mean + k * deviation
+        sauvola   // mean * (1 + k * (deviation / 128 - 1))
+    };
+
+    inline void adaptive_threshold_band(const band& b, const window_statistics* statistics, int radius, local_threshold method, float parameter)
+    {
+        const int w = b.image_width, h = b.image_height, ch = b.channels;
+
+        for (int y = b.top; y < b.bottom; ++y)
+        {
+            int y0 = std::max(0, y - radius), y1 = std::min(h, y + radius + 1);
+            uchar* row = b.destination + size_t(y) * w * ch;
+
+            for (int x = b.left; x < b.right; ++x)
+            {
+                int x0 = std::max(0, x - radius), x1 = std::min(w, x + radius + 1);
+                uint32_t sum, square_sum;
+                statistics->sums(x0, y0, x1, y1, sum, square_sum);
+
+                float count = float((x1 - x0) * (y1 - y0));
+                float mean = sum / count;
+
+                float t;
+                if (method == local_threshold::mean_c)
+                    t = mean - parameter;
+                else
+                {
+                    float deviation = std::sqrt(std::max(0.0f, square_sum / count - mean * mean));
+                    if (method == local_threshold::niblack)
+                        t = mean + parameter * deviation;
+                    else
+                        t = mean * (1.0f + parameter * (deviation / 128.0f - 1.0f));
+                }
+
+                uchar* p = row + x * ch;
+                int gray = ch == 3 ? (int(p[0]) + int(p[1]) + int(p[2])) / 3 : p[0];
+                uchar v = gray < t ? 0 : 255;
+                for (int c = 0; c < ch; ++c)
+                    p[c] = v;
+            }
+        }
+    }
+
+    // Local threshold over a window x window neighbourhood in one pass, including the conversion to gray.
+    // parameter is C for mean_c and k for niblack and sauvola.
+    inline void adaptive_threshold(mask& m, int window = 15, local_threshold method = local_threshold::sauvola, float parameter = 0.34f)
+    {
+        PPFIS_TRACE_SCOPE("adaptive_threshold");
+
+        scratch_scope scope;
+        window_statistics statistics;
+        if (!statistics.build(m))
+            return;
+
+        int radius = std::max(0, std::min(window_statistics::maximum_window, window) / 2);
+
+        void (*func)(const band&, const window_statistics*, int, local_threshold, float) = adaptive_threshold_band;
+        m.operate_in_place(func, const_cast<const window_statistics*>(&statistics), radius, method, parameter);
+    }
+
+    // edge detection
+    enum class magnitude
+    {
+        l1,     // |x| + |y|
+        l2,     // sqrt(x * x + y * y)
+        approx  // (123 * max + 51 * min) / 128, about 0.96 * max + 0.4 * min, no square root
+    };
+
+    // orientation is quantised into 4 sectors of the gradient direction:
+    // 0 = horizontal, 1 = diagonal (+x +y), 2 = vertical, 3 = diagonal (+x -y)
+    inline void sobel_band(const band& b, magnitude mode, uchar* orientation)
+    {
+        const int w = b.image_width, ch = b.channels;
+        const int n = b.right - b.left;
+        if (n <= 0) return;
+
+        // gray value is read from the r channel for CV_8UC3
+        const int offset = ch == 3 ? 2 : 0;
+
+        // per column vertical sums shared by both gradients, v = a + 2b + c, d = c - a
+        // index i is column left - 1 + i
+        int* v = b.scratch->allocate_array<int>(n + 2);
+        int* d = b.scratch->allocate_array<int>(n + 2);
+        int* g = b.scratch->allocate_array<int>(n);
+
+        for (int y = b.top; y < b.bottom; ++y)
+        {
+            const uchar* ra = b.source + size_t(std::max(y - 1, 0)) * w * ch + offset;
+            const uchar* rb = b.source + size_t(y) * w * ch + offset;
+            const uchar* rc = b.source + size_t(std::min(y + 1, b.image_height - 1)) * w * ch + offset;
+
+            {
+                const uchar* __restrict a = ra + b.left * ch;
+                const uchar* __restrict m = rb + b.left * ch;
+                const uchar* __restrict c = rc + b.left * ch;
+                int* __restrict vp = v + 1;
+                int* __restrict dp = d + 1;
+                for (int i = 0; i < n; ++i)
+                {
+                    vp[i] = a[i * ch] + 2 * m[i * ch] + c[i * ch];
+                    dp[i] = c[i * ch] - a[i * ch];
+                }
+            }
+
+            // replicate the image edge
+            int xl = std::max(b.left - 1, 0) * ch, xr = std::min(b.right, w - 1) * ch;
+            v[0] = ra[xl] + 2 * rb[xl] + rc[xl];
+            d[0] = rc[xl] - ra[xl];
+            v[n + 1] = ra[xr] + 2 * rb[xr] + rc[xr];
+            d[n + 1] = rc[xr] - ra[xr];
+
+            {
+                const int* __restrict vp = v;
+                const int* __restrict dp = d;
+                int* __restrict gp = g;
+                switch (mode)
+                {
+                case magnitude::l1:
+                    for (int i = 0; i < n; ++i)
+                        gp[i] = std::min(std::abs(vp[i + 2] - vp[i]) + std::abs(dp[i] + 2 * dp[i + 1] + dp[i + 2]), 255);
+                    break;
+                case magnitude::l2:
+                    for (int i = 0; i < n; ++i)
+                    {
+                        int gx = vp[i + 2] - vp[i];
+                        int gy = dp[i] + 2 * dp[i + 1] + dp[i + 2];
+                        gp[i] = int(std::sqrt(float(std::min(gx * gx + gy * gy, 255 * 255))));
+                    }
+                    break;
+                case magnitude::approx:
+                    for (int i = 0; i < n; ++i)
+                    {
+                        int gx = std::abs(vp[i + 2] - vp[i]);
+                        int gy = std::abs(dp[i] + 2 * dp[i + 1] + dp[i + 2]);
+                        gp[i] = std::min((std::max(gx, gy) * 123 + std::min(gx, gy) * 51) >> 7, 255);
+                    }
+                    break;
+                }
+            }
+
+            uchar* out = b.destination + (size_t(y) * w + b.left) * ch;
+            if (ch == 3)
+                for (int i = 0; i < n; ++i)
+                    out[i * 3] = out[i * 3 + 1] = out[i * 3 + 2] = uchar(g[i]);
+            else
+                for (int i = 0; i < n; ++i)
+                    out[i] = uchar(g[i]);
+
+            if (orientation)
+            {
+                // tan(22.5) and tan(67.5) in 1/32768 units
+                uchar* o = orientation + size_t(y) * w + b.left;
+                for (int i = 0; i < n; ++i)
+                {
+                    int gx = v[i + 2] - v[i];
+                    int gy = d[i] + 2 * d[i + 1] + d[i + 2];
+                    int ax = std::abs(gx), ay = std::abs(gy) * 32768;
+                    if (ay <= ax * 13573)
+                        o[i] = 0;
+                    else if (ay >= ax * 79109)
+                        o[i] = 2;
+                    else
+                        o[i] = (gx ^ gy) >= 0 ? 1 : 3;
+                }
+            }
+        }
+    }
+
+    // Both gradients are computed in a single pass from shared row sums.
+    // orientation, if given, is a single channel plane of the same size as the mask.
+    inline void sobel_operator(mask& m, magnitude mode = magnitude::l2, uchar* orientation = nullptr)
+    {
+        PPFIS_TRACE_SCOPE("sobel_operator");
+
+        void (*func)(const band&, magnitude, uchar*) = sobel_band;
+
+        m.operate(func, mode, orientation);
+    }
+
+    // convolution kernel with compile time coefficients, row major, result is divided by divisor
+    template <int kernel_size, int kernel_divisor, int ... kernel_coefficients>
+    struct kernel
+    {
+        static_assert(kernel_size % 2 == 1, "kernel size must be odd");
+        static_assert(sizeof...(kernel_coefficients) == kernel_size * kernel_size, "kernel needs size * size coefficients");
+        static_assert(kernel_divisor > 0, "kernel divisor must be positive");
+
+        static constexpr int size = kernel_size;
+        static constexpr int radius = kernel_size / 2;
+        static constexpr int divisor = kernel_divisor;
+        static constexpr int coefficients[kernel_size * kernel_size] = { kernel_coefficients... };
+    };
+
+    using laplacian_kernel = kernel<3, 1,  0,  1,  0,
+                                           1, -4,  1,
+                                           0,  1,  0>;
+
+    using sharpen_kernel = kernel<3, 1,  0, -1,  0,
+                                        -1,  5, -1,
+                                         0, -1,  0>;
+
+    using box_kernel = kernel<3, 9,  1,  1,  1,
+                                     1,  1,  1,
+                                     1,  1,  1>;
+
+    using gaussian_kernel = kernel<3, 16,  1,  2,  1,
+                                           2,  4,  2,
+                                           1,  2,  1>;
+
+    // integer rank 1 decomposition, coefficient(r, c) == column[r] * row[c]
+    template <int size>
+    struct kernel_factors
+    {
+        bool separable = false;
+        int row[size] = {0};
+        int column[size] = {0};
+    };
+
+    template <typename K>
+    constexpr kernel_factors<K::size> factorise_kernel()
+    {
+        constexpr int n = K::size;
+        kernel_factors<n> f;
+
+        // first non zero coefficient
+        int r0 = -1, c0 = -1;
+        for (int i = 0; i < n * n && r0 < 0; ++i)
+            if (K::coefficients[i] != 0)
+            {
+                r0 = i / n;
+                c0 = i % n;
+            }
+        if (r0 < 0)
+            return f;
+
+        int divisor = 0;
+        for (int c = 0; c < n; ++c)
+            divisor = std::gcd(divisor, K::coefficients[r0 * n + c]);
+        if (K::coefficients[r0 * n + c0] < 0)
+            divisor = -divisor;
+
+        for (int c = 0; c < n; ++c)
+            f.row[c] = K::coefficients[r0 * n + c] / divisor;
+
+        for (int r = 0; r < n; ++r)
+        {
+            if (K::coefficients[r * n + c0] % f.row[c0] != 0)
+                return kernel_factors<n>();
+            f.column[r] = K::coefficients[r * n + c0] / f.row[c0];
+        }
+
+        for (int r = 0; r < n; ++r)
+            for (int c = 0; c < n; ++c)
+                if (K::coefficients[r * n + c] != f.column[r] * f.row[c])
+                    return kernel_factors<n>();
+
+        f.separable = true;
+        return f;
+    }
+
+    // Taps are unrolled at compile time and zero taps generate no code.
+    // Separable kernels are detected and applied as a vertical then a horizontal pass.
+    template <typename K>
+    struct convolution
+    {
+        static constexpr kernel_factors<K::size> factors = factorise_kernel<K>();
+        using taps = std::make_integer_sequence<int, K::size * K::size>;
+        using line_taps = std::make_integer_sequence<int, K::size>;
+
+        // non separable, e is an element index that is at least radius pixels away from the edges
+        template <int index>
+        static inline int tap(const uchar* const* rows, int e, int ch)
+        {
+            constexpr int c = K::coefficients[index];
+            if constexpr (c == 0)
+                return 0;
+            else
+                return c * rows[index / K::size][e + (index % K::size - K::radius) * ch];
+        }
+
+        template <int ... index>
+        static inline int sum(const uchar* const* rows, int e, int ch, std::integer_sequence<int, index...>)
+        {
+            return (0 + ... + tap<index>(rows, e, ch));
+        }
+
+        // non separable, x is clamped to the image for every tap
+        template <int index>
+        static inline int clamped_tap(const uchar* const* rows, int x, int c, int ch, int w)
+        {
+            constexpr int k = K::coefficients[index];
+            if constexpr (k == 0)
+                return 0;
+            else
+                return k * rows[index / K::size][std::max(0, std::min(w - 1, x + index % K::size - K::radius)) * ch + c];
+        }
+
+        template <int ... index>
+        static inline int clamped_sum(const uchar* const* rows, int x, int c, int ch, int w, std::integer_sequence<int, index...>)
+        {
+            return (0 + ... + clamped_tap<index>(rows, x, c, ch, w));
+        }
+
+        // separable, vertical pass
+        template <int index>
+        static inline int column_tap(const uchar* const* rows, int e)
+        {
+            constexpr int k = factors.column[index];
+            if constexpr (k == 0)
+                return 0;
+            else
+                return k * rows[index][e];
+        }
+
+        template <int ... index>
+        static inline int column_sum(const uchar* const* rows, int e, std::integer_sequence<int, index...>)
+        {
+            return (0 + ... + column_tap<index>(rows, e));
+        }
+
+        // separable, horizontal pass over the vertically filtered line
+        template <int index>
+        static inline int row_tap(const int* line, int i, int ch)
+        {
+            constexpr int k = factors.row[index];
+            if constexpr (k == 0)
+                return 0;
+            else
+                return k * line[i + index * ch];
+        }
+
+        template <int ... index>
+        static inline int row_sum(const int* line, int i, int ch, std::integer_sequence<int, index...>)
+        {
+            return (0 + ... + row_tap<index>(line, i, ch));
+        }
+
+        static void convolve_band(const band& b)
+        {
+            constexpr int r = K::radius;
+            const int w = b.image_width, h = b.image_height, ch = b.channels;
+            const int n = (b.right - b.left) * ch;
+            if (n <= 0) return;
+
+            int* acc = b.scratch->allocate_array<int>(n);
+            int* line = factors.separable ? b.scratch->allocate_array<int>(n + 2 * r * ch) : nullptr;
+
+            const uchar* rows[K::size];
+
+            for (int y = b.top; y < b.bottom; ++y)
+            {
+                for (int i = 0; i < K::size; ++i)
+                    rows[i] = b.source + size_t(std::max(0, std::min(h - 1, y + i - r))) * w * ch;
+
+                if constexpr (factors.separable)
+                {
+                    // line[j] is column left - r + j / ch, element e of the image row is line[e - base], edges are replicated
+                    int xa = std::max(b.left - r, 0), xb = std::min(b.right + r, w);
+                    const int base = (b.left - r) * ch;
+                    for (int e = xa * ch; e < xb * ch; ++e)
+                        line[e - base] = column_sum(rows, e, line_taps());
+                    for (int x = b.left - r; x < xa; ++x)
+                        for (int c = 0; c < ch; ++c)
+                            line[x * ch + c - base] = line[xa * ch + c - base];
+                    for (int x = xb; x < b.right + r; ++x)
+                        for (int c = 0; c < ch; ++c)
+                            line[x * ch + c - base] = line[(xb - 1) * ch + c - base];
+
+                    for (int i = 0; i < n; ++i)
+                        acc[i] = row_sum(line, i, ch, line_taps());
+                }
+                else
+                {
+                    // element e of the image row is acc[e - base]
+                    int x0 = std::max(b.left, r), x1 = std::max(x0, std::min(b.right, w - r));
+                    const int base = b.left * ch;
+                    for (int e = x0 * ch; e < x1 * ch; ++e)
+                        acc[e - base] = sum(rows, e, ch, taps());
+                    for (int x = b.left; x < std::min(x0, b.right); ++x)
+                        for (int c = 0; c < ch; ++c)
+                            acc[x * ch + c - base] = clamped_sum(rows, x, c, ch, w, taps());
+                    for (int x = std::max(x1, b.left); x < b.right; ++x)
+                        for (int c = 0; c < ch; ++c)
+                            acc[x * ch + c - base] = clamped_sum(rows, x, c, ch, w, taps());
+                }
+
+                // saturate
+                uchar* __restrict out = b.destination + (size_t(y) * w + b.left) * ch;
+                const int* __restrict a = acc;
+                for (int i = 0; i < n; ++i)
+                {
+                    int v = a[i];
+                    if constexpr (K::divisor != 1)
+                        v = (v + K::divisor / 2) / K::divisor;
+                    out[i] = uchar(std::max(0, std::min(255, v)));
+                }
+            }
+        }
+    };
+
+    template <typename K>
+    inline void convolve(mask& m)
+    {
+        void (*func)(const band&) = convolution<K>::convolve_band;
+
+        m.operate(func);
+    }
+
+    inline void laplacian(mask& m)
+    {
+        PPFIS_TRACE_SCOPE("laplacian");
+
+        convolve<laplacian_kernel>(m);
+    }
+
+    // filtering
+    inline void sharpen_filter(mask& m)
+    {
+        PPFIS_TRACE_SCOPE("sharpen_filter");
+
+        convolve<sharpen_kernel>(m);
+    }
+
+    inline void mean_filter(mask& m, int k)
+    {
+        PPFIS_TRACE_SCOPE("mean_filter");
+
+        void (*mean_func)(pixels&, pixel&, int) = [](pixels& op, pixel& np, int k)
+        {
+            int power = k * k;
+            int size = (k-1)/2;
+
+            int r = 0, g = 0, b = 0;
+
+            for (int row = -1 * size; row < size + 1; row++)
+                for (int col = -1 * size; col < size + 1; col++)
+                {
+                    const pixel& p = op.at(row, col);
+                    r += p.r;
+                    g += p.g;
+                    b += p.b;
+                }
+            np = pixel(b/pow(k, 2), g/pow(k, 2), r/pow(k, 2));
+        };
+
+        m.operate(mean_func, k);
+    }
+
+    // Borders replicate the edge pixels like cv::medianBlur. The per pixel version this replaced clamped to one past
+    // the right and bottom edge instead, reading the first pixel of the next row and the row after the image.
+    inline void median_band(const band& b, int k)
+    {
+        const int w = b.image_width, h = b.image_height, ch = b.channels;
+        int power = k * k;
+        int size = (k-1)/2;
+
+        // for even k the window is k-1 wide and the rest of the k * k values stay 0, as it always has been
+        int* values = b.scratch->allocate_array<int>(size_t(power) * ch);
+
+        for (int y = b.top; y < b.bottom; ++y)
+            for (int x = b.left; x < b.right; ++x)
+            {
+                std::fill(values, values + power * ch, 0);
+
+                int i = 0;
+                for (int row = -1 * size; row < size + 1; row++)
+                {
+                    const uchar* line = b.source + size_t(std::max(0, std::min(h - 1, y + row))) * w * ch;
+                    for (int col = -1 * size; col < size + 1; col++)
+                    {
+                        const uchar* p = line + std::max(0, std::min(w - 1, x + col)) * ch;
+                        for (int c = 0; c < ch; ++c)
+                            values[c * power + i] = p[c];
+                        i++;
+                    }
+                }
+
+                uchar* out = b.destination + (size_t(y) * w + x) * ch;
+                for (int c = 0; c < ch; ++c)
+                {
+                    int* v = values + c * power;
+                    std::nth_element(v, v + power/2, v + power);
+                    out[c] = uchar(v[power/2]);
+                }
+            }
+    }
+
+    inline void median_filter(mask& m, int k)
+    {
+        PPFIS_TRACE_SCOPE("median_filter");
+
+        void (*median_func)(const band&, int) = median_band;
+
+        m.operate(median_func, k);
+    }
+
+    // morphological
+    inline void erosion(mask& m)
+    {
+        PPFIS_TRACE_SCOPE("erosion");
+
+        void (*func)(pixels& op, pixel& np) = [](pixels& op, pixel& np)
+        {
+            constexpr int filter[3][3] = {{  1,  1,  1},
+                                          {  1,  1,  1},
+                                          {  1,  1,  1}};
+            int value = 255;
+            for (int row = -1; row < 2; row++)
+                for (int col = -1; col < 2; col++)
+                {
+                    const pixel& p = op.at(row, col);
+                    if (filter[row+1][col+1] == 1) 
+                        if (p.r != 255)
+                            value = 0;
+                }
+            np = value;
+        };
+
+        m.operate(func);
+    }
+
+    inline void dilation(mask& m)
+    {
+        PPFIS_TRACE_SCOPE("dilation");
+
+        void (*func)(pixels& op, pixel& np) = [](pixels& op, pixel& np)
+        {
+            constexpr int filter[3][3] = {{  1,  1,  1},
+                                          {  1,  1,  1},
+                                          {  1,  1,  1}};
+            int value = 0;
+            for (int row = -1; row < 2; row++)
+                for (int col = -1; col < 2; col++)
+                {
+                    const pixel& p = op.at(row, col);
+                    if (filter[row+1][col+1] == 1)
+                        if (p.r == 255)
+                            value = 255;
+                }
+            np = value;
         };
 
-        m.operate(func);
+        m.operate(func);
+    }
+
+    inline void opening(mask& m)
+    {
+        PPFIS_TRACE_SCOPE("opening");
+
+        erosion(m);
+        dilation(m);
+    }
+
+    inline void closing(mask& m)
+    {
+        PPFIS_TRACE_SCOPE("closing");
+
+        dilation(m);
+        erosion(m);
+    }
+
+    // resize ===
+    enum class interpolation
+    {
+        bilinear,  // pixel centres like cv::INTER_LINEAR
+        area       // averages the covered pixels like cv::INTER_AREA, bilinear for levels that enlarge
+    };
+
+    // one output of resize_levels, image holds height x width pixels with the channels of the mask
+    struct scale_level
+    {
+        double scale;
+        uchar* image;
+        int width, height;
+    };
+
+    // output size for a scale, rounded like cv::resize with cv::Size() and a factor
+    inline int scaled_size(int size, double scale)
+    {
+        return int(std::lrint(size * scale));
+    }
+
+    // Taps of every output row or column: output i is the weighted sum of inputs index[i * taps + k].
+    // Outputs with fewer taps repeat their last input with weight 0, so every output has the same tap count.
+    // Inputs of an output are consecutive and ascending, index[i * taps] is the first one it needs.
+    struct resize_taps
+    {
+        int taps;
+        int* index;
+        float* weight;
+
+        inline void build(scratch_arena& arena, int input_size, int output_size, double scale, interpolation method)
+        {
+            const double inverse = 1.0 / scale;
+            const bool area = method == interpolation::area && scale < 1.0;
+            taps = area ? int(std::ceil(inverse)) + 1 : 2;
+
+            index = arena.allocate_array<int>(size_t(output_size) * taps);
+            weight = arena.allocate_array<float>(size_t(output_size) * taps);
+
+            for (int i = 0; i < output_size; ++i)
+            {
+                int* in = index + size_t(i) * taps;
+                float* wt = weight + size_t(i) * taps;
+                int count = 0;
+                if (area)
+                {
+                    double begin = i * inverse, end = std::min((i + 1) * inverse, double(input_size));
+                    for (int j = int(begin); j < end && j < input_size; ++j)
+                    {
+                        double covered = std::min(end, j + 1.0) - std::max(begin, double(j));
+                        if (covered <= 1e-9)
+                            continue;
+                        in[count] = j;
+                        wt[count++] = float(covered / (end - begin));
+                    }
+                }
+                else
+                {
+                    double position = (i + 0.5) * inverse - 0.5;
+                    int j = int(std::floor(position));
+                    float fraction = float(position - j);
+                    if (j < 0)
+                    {
+                        j = 0;
+                        fraction = 0;
+                    }
+                    if (j >= input_size - 1)
+                    {
+                        j = input_size - 1;
+                        fraction = 0;
+                    }
+                    in[count] = j;
+                    wt[count++] = 1.0f - fraction;
+                    if (fraction > 0)
+                    {
+                        in[count] = j + 1;
+                        wt[count++] = fraction;
+                    }
+                }
+
+                for (; count < taps; ++count)
+                {
+                    in[count] = in[count - 1];
+                    wt[count] = 0;
+                }
+            }
+        }
+    };
+
+    struct resize_operation
+    {
+        const scale_level* levels;
+        const resize_taps* columns;
+        const resize_taps* rows;
+        int count;
+    };
+
+    // horizontal pass of one input row into a level's width
+    template <int channels>
+    inline void resize_row(const uchar* input, const resize_taps& columns, int width, float* output)
+    {
+        const int taps = columns.taps;
+        if (taps == 2)
+        {
+            for (int dx = 0; dx < width; ++dx)
+            {
+                const uchar* p0 = input + columns.index[dx * 2] * channels;
+                const uchar* p1 = input + columns.index[dx * 2 + 1] * channels;
+                const float w0 = columns.weight[dx * 2], w1 = columns.weight[dx * 2 + 1];
+                for (int c = 0; c < channels; ++c)
+                    output[dx * channels + c] = w0 * p0[c] + w1 * p1[c];
+            }
+            return;
+        }
+
+        for (int dx = 0; dx < width; ++dx)
+        {
+            const int* in = columns.index + size_t(dx) * taps;
+            const float* wt = columns.weight + size_t(dx) * taps;
+            for (int c = 0; c < channels; ++c)
+            {
+                float v = 0;
+                for (int t = 0; t < taps; ++t)
+                    v += wt[t] * input[in[t] * channels + c];
+                output[dx * channels + c] = v;
+            }
+        }
+    }
+
+    // Bands split the input rows, an output row belongs to the band holding its first input row.
+    // The band walks its rows once and writes the output rows of every level as soon as their first row is reached,
+    // so all levels come out of one pass over the input. Output rows may read input rows of the next band.
+    // Horizontally resized rows are kept per level in a ring of one slot per row tap, so each input row is resized once per level.
+    inline void resize_band(const band& b, const resize_operation* op)
+    {
+        const int w = b.image_width, ch = b.channels;
+
+        struct level_state
+        {
+            int next_row;   // first output row not written yet
+            float* slots;   // rows.taps horizontally resized input rows
+            int* slot_row;  // input row held by each slot, -1 when empty
+            float** row;    // slot of each tap of the current output row
+        };
+        level_state* states = b.scratch->allocate_array<level_state>(op->count);
+
+        for (int l = 0; l < op->count; ++l)
+        {
+            const resize_taps& rows = op->rows[l];
+            level_state& s = states[l];
+            s.next_row = 0;
+            while (s.next_row < op->levels[l].height && rows.index[size_t(s.next_row) * rows.taps] < b.top)
+                ++s.next_row;
+            s.slots = b.scratch->allocate_array<float>(size_t(rows.taps) * op->levels[l].width * ch);
+            s.slot_row = b.scratch->allocate_array<int>(rows.taps);
+            s.row = b.scratch->allocate_array<float*>(rows.taps);
+            std::fill(s.slot_row, s.slot_row + rows.taps, -1);
+        }
+
+        for (int y = b.top; y < b.bottom; ++y)
+            for (int l = 0; l < op->count; ++l)
+            {
+                const scale_level& level = op->levels[l];
+                const resize_taps& rows = op->rows[l];
+                level_state& s = states[l];
+                const int row_size = level.width * ch;
+
+                for (; s.next_row < level.height && rows.index[size_t(s.next_row) * rows.taps] == y; ++s.next_row)
+                {
+                    const int* in = rows.index + size_t(s.next_row) * rows.taps;
+                    const float* wt = rows.weight + size_t(s.next_row) * rows.taps;
+
+                    uchar* output = level.image + size_t(s.next_row) * row_size;
+                    float** row = s.row;
+                    for (int t = 0; t < rows.taps; ++t)
+                    {
+                        const int slot = in[t] % rows.taps;
+                        row[t] = s.slots + size_t(slot) * row_size;
+                        if (s.slot_row[slot] != in[t])
+                        {
+                            const uchar* input = b.source + size_t(in[t]) * w * ch;
+                            if (ch == 3)
+                                resize_row<3>(input, op->columns[l], level.width, row[t]);
+                            else
+                                resize_row<1>(input, op->columns[l], level.width, row[t]);
+                            s.slot_row[slot] = in[t];
+                        }
+                    }
+
+                    if (rows.taps == 2)
+                    {
+                        const float* r0 = row[0];
+                        const float* r1 = row[1];
+                        const float w0 = wt[0], w1 = wt[1];
+                        for (int i = 0; i < row_size; ++i)
+                            output[i] = uchar(std::min(255.0f, w0 * r0[i] + w1 * r1[i] + 0.5f));
+                    }
+                    else
+                        for (int i = 0; i < row_size; ++i)
+                        {
+                            float v = 0.5f;
+                            for (int t = 0; t < rows.taps; ++t)
+                                v += wt[t] * row[t][i];
+                            output[i] = uchar(std::min(255.0f, v));
+                        }
+                }
+            }
     }
 
-    inline void laplacian(mask& m)
+    // Resizes the whole image into every level in one pass, the mask itself is not modified.
+    // level width and height are filled in from the scale, image must hold scaled_size of both.
+    inline bool resize_levels(mask& m, scale_level* levels, int count, interpolation method = interpolation::bilinear)
     {
-        void (*func)(pixels& op, pixel& np) = [](pixels& op, pixel& np)
+        PPFIS_TRACE_SCOPE("resize_levels");
+
+        int left = m.border_left, top = m.border_top, right = m.border_right, bottom = m.border_bottom;
+        m.set_relative_border(0, 0, 0, 0);
+        const int w = m.border_right, h = m.border_bottom;
+
+        scratch_scope scope;
+        scratch_arena& arena = scratch_arena::local();
+        resize_taps* columns = arena.allocate_array<resize_taps>(count);
+        resize_taps* rows = arena.allocate_array<resize_taps>(count);
+        bool result = w > 0 && h > 0;
+        for (int l = 0; l < count && result; ++l)
         {
-            constexpr int filter[3][3] = {{  0,  1,  0},
-                                          {  1, -4,  1},
-                                          {  0,  1,  0}};
-            int r = 0, g = 0, b = 0;
-            for (int row = -1; row < 2; row++)
-                for (int col = -1; col < 2; col++)
-                {
-                    const pixel& p = op.at(row, col);
-                    r += filter[row+1][col+1] * p.r;
-                    g += filter[row+1][col+1] * p.g;
-                    b += filter[row+1][col+1] * p.b;
-                }
-            
-            r = std::max(0,std::min(255, r));
-            g = std::max(0,std::min(255, g));
-            b = std::max(0,std::min(255, b));
+            levels[l].width = scaled_size(w, levels[l].scale);
+            levels[l].height = scaled_size(h, levels[l].scale);
+            result = levels[l].image && levels[l].width > 0 && levels[l].height > 0;
+            if (result)
+            {
+                columns[l].build(arena, w, levels[l].width, levels[l].scale, method);
+                rows[l].build(arena, h, levels[l].height, levels[l].scale, method);
+            }
+        }
 
-            np = pixel(b,g,r);
-        };
+        if (result)
+        {
+            resize_operation op = { levels, columns, rows, count };
+            void (*func)(const band&, const resize_operation*) = resize_band;
+            result = m.operate_in_place(func, const_cast<const resize_operation*>(&op));
+        }
 
-        m.operate(func);
+        m.set_border(left, top, right, bottom);
+        return result;
     }
 
-    // filtering
-    inline void sharpen_filter(mask& m)
+    inline bool resize(mask& m, uchar* destination, double scale, interpolation method = interpolation::bilinear)
     {
-        void (*func)(pixels& op, pixel& np) = [](pixels& op, pixel& np)
+        scale_level level = { scale, destination, 0, 0 };
+        return resize_levels(m, &level, 1, method);
+    }
+
+    // connected components ===
+    // bounding box is [left, right) x [top, bottom)
+    struct component
+    {
+        int left, top, right, bottom;
+        int area;
+        float centroid_x, centroid_y;
+    };
+
+    // Union find over pixel indices, a root is always the smallest index of its tree.
+    struct component_labelling
+    {
+        int* parent;
+        int* labels;
+        uchar* band_starts;
+        uchar foreground;
+        bool eight_connected;
+
+        inline int find(int i)
         {
-            constexpr int filter[3][3] = {{  0, -1,  0},
-                                          { -1,  5, -1},
-                                          {  0, -1,  0}};
-            int r = 0, g = 0, b = 0;
-            for (int row = -1; row < 2; row++)
-                for (int col = -1; col < 2; col++)
-                {
-                    const pixel& p = op.at(row, col);
-                    r += filter[row+1][col+1] * p.r;
-                    g += filter[row+1][col+1] * p.g;
-                    b += filter[row+1][col+1] * p.b;
-                }
-            
-            r = std::max(0,std::min(255, r));
-            g = std::max(0,std::min(255, g));
-            b = std::max(0,std::min(255, b));
+            while (parent[i] != i)
+            {
+                parent[i] = parent[parent[i]];
+                i = parent[i];
+            }
+            return i;
+        }
 
-            np = pixel(b,g,r);
-        };
+        inline void unite(int a, int b)
+        {
+            a = find(a);
+            b = find(b);
+            if (a < b)
+                parent[b] = a;
+            else if (b < a)
+                parent[a] = b;
+        }
 
-        m.operate(func);
-    }
+        // unites pixel (x, y) with its foreground neighbours in row y - 1
+        inline void unite_above(const band& b, const uchar* image, int x, int y)
+        {
+            const int w = b.image_width, ch = b.channels, offset = ch == 3 ? 2 : 0;
+            const int i = y * w + x;
+            const uchar* above = image + size_t(y - 1) * w * ch + offset;
 
-    inline void mean_filter(mask& m, int k)
+            if (above[x * ch] == foreground)
+                unite(i, i - w);
+            if (eight_connected)
+            {
+                if (x > b.left && above[(x - 1) * ch] == foreground)
+                    unite(i, i - w - 1);
+                if (x + 1 < b.right && above[(x + 1) * ch] == foreground)
+                    unite(i, i - w + 1);
+            }
+        }
+    };
+
+    // labels the rows of one band as if it were the whole image, trees never leave the band
+    inline void label_band(const band& b, component_labelling* l)
     {
-        void (*mean_func)(pixels&, pixel&, int) = [](pixels& op, pixel& np, int k)
+        const int w = b.image_width, ch = b.channels, offset = ch == 3 ? 2 : 0;
+        l->band_starts[b.top] = 1;
+
+        for (int y = b.top; y < b.bottom; ++y)
         {
-            int power = k * k;
-            int size = (k-1)/2;
+            const uchar* row = b.source + size_t(y) * w * ch + offset;
+            for (int x = b.left; x < b.right; ++x)
+            {
+                if (row[x * ch] != l->foreground)
+                    continue;
+
+                int i = y * w + x;
+                l->parent[i] = i;
+                if (x > b.left && row[(x - 1) * ch] == l->foreground)
+                    l->unite(i, i - 1);
+                if (y > b.top)
+                    l->unite_above(b, b.source, x, y);
+            }
+        }
+    }
 
-            int r = 0, g = 0, b = 0;
+    // merges the first row of every band but the top one with the row above, run as a single band
+    inline void seam_band(const band& b, component_labelling* l)
+    {
+        const int w = b.image_width, ch = b.channels, offset = ch == 3 ? 2 : 0;
+        for (int y = b.top + 1; y < b.bottom; ++y)
+        {
+            if (!l->band_starts[y])
+                continue;
+            const uchar* row = b.source + size_t(y) * w * ch + offset;
+            for (int x = b.left; x < b.right; ++x)
+                if (row[x * ch] == l->foreground)
+                    l->unite_above(b, b.source, x, y);
+        }
+    }
 
-            for (int row = -1 * size; row < size + 1; row++)
-                for (int col = -1 * size; col < size + 1; col++)
+    // after the band seams are merged, every foreground pixel gets its root; parent is only read here
+    inline void resolve_band(const band& b, component_labelling* l)
+    {
+        const int w = b.image_width, ch = b.channels, offset = ch == 3 ? 2 : 0;
+        for (int y = b.top; y < b.bottom; ++y)
+        {
+            const uchar* row = b.source + size_t(y) * w * ch + offset;
+            for (int x = b.left; x < b.right; ++x)
+                if (row[x * ch] == l->foreground)
                 {
-                    const pixel& p = op.at(row, col);
-                    r += p.r;
-                    g += p.g;
-                    b += p.b;
+                    int i = y * w + x;
+                    while (l->parent[i] != i)
+                        i = l->parent[i];
+                    l->labels[y * w + x] = i;
                 }
-            np = pixel(b/pow(k, 2), g/pow(k, 2), r/pow(k, 2));
-        };
-
-        m.operate(mean_func, k);
+        }
     }
 
-    inline void median_filter(mask& m, int k)
+    // Labels pixels equal to foreground (r channel for 3 channels) inside the mask borders.
+    // Bands are labelled in parallel, then only the seams between bands are merged.
+    // labels, if given, receives width * height component indices, -1 for background.
+    inline std::vector<component> connected_components(mask& m, int* labels = nullptr, uchar foreground = 255, bool eight_connected = true)
     {
-        void (*median_func)(pixels&, pixel&, int) = [](pixels& op, pixel& np, int k) {
-            int power = k * k;
-            int size = (k-1)/2;
-
-            std::vector<int> r(power, 0);
-            std::vector<int> g(power, 0);
-            std::vector<int> b(power, 0);
+        PPFIS_TRACE_SCOPE("connected_components");
+
+        std::vector<component> components;
+
+        int left = m.border_left, top = m.border_top, right = m.border_right, bottom = m.border_bottom;
+        m.set_relative_border(0, 0, 0, 0);
+        const int w = m.border_right, h = m.border_bottom;
+        m.set_border(left, top, right, bottom);
+        if (w <= 0 || h <= 0)
+            return components;
+
+        scratch_scope scope;
+        scratch_arena& arena = scratch_arena::local();
+
+        component_labelling l;
+        l.parent = arena.allocate_array<int>(size_t(w) * h);
+        l.labels = labels ? labels : arena.allocate_array<int>(size_t(w) * h);
+        l.band_starts = arena.allocate_array<uchar>(h);
+        l.foreground = foreground;
+        l.eight_connected = eight_connected;
+        memset(l.labels, 0xff, sizeof(int) * size_t(w) * h);
+        memset(l.band_starts, 0, h);
+
+        void (*label)(const band&, component_labelling*) = label_band;
+        if (!m.operate_in_place(label, &l))
+            return components;
+
+        // the seams touch trees of two bands, so they are merged by one thread
+        int thread_count = m.get_thread_count();
+        m.set_thread_count(0);
+        void (*seam)(const band&, component_labelling*) = seam_band;
+        m.operate_in_place(seam, &l);
+        m.set_thread_count(thread_count);
+
+        void (*resolve)(const band&, component_labelling*) = resolve_band;
+        m.operate_in_place(resolve, &l);
+
+        // number the roots in raster order and gather the statistics
+        std::vector<double> sum_x, sum_y;
+        for (int y = 0; y < h; ++y)
+            for (int x = 0; x < w; ++x)
+            {
+                int& label_of = l.labels[y * w + x];
+                if (label_of < 0)
+                    continue;
 
-            int i = 0;
-            for (int row = -1 * size; row < size + 1; row++)
-                for (int col = -1 * size; col < size + 1; col++)
+                int& root = l.parent[label_of];
+                if (root >= 0)
                 {
-                    const pixel& p = op.at(row, col);
-                    r[i] = p.r;
-                    g[i] = p.g;
-                    b[i] = p.b;
-                    i++;
+                    root = -int(components.size()) - 1;
+                    components.push_back({ x, y, x + 1, y + 1, 0, 0, 0 });
+                    sum_x.push_back(0);
+                    sum_y.push_back(0);
                 }
+                int index = -root - 1;
+                label_of = index;
+
+                component& c = components[index];
+                c.left = std::min(c.left, x);
+                c.right = std::max(c.right, x + 1);
+                c.bottom = y + 1;
+                c.area++;
+                sum_x[index] += x;
+                sum_y[index] += y;
+            }
 
-            std::sort(r.begin(), r.end()); 
-            std::sort(g.begin(), g.end()); 
-            std::sort(b.begin(), b.end());
+        for (size_t i = 0; i < components.size(); ++i)
+        {
+            components[i].centroid_x = float(sum_x[i] / components[i].area);
+            components[i].centroid_y = float(sum_y[i] / components[i].area);
+        }
 
-            np = pixel(b[power/2], g[power/2], r[power/2]);
-        };
+        return components;
+    }
 
-        m.operate(median_func, k);
+    // image search ===
+    // 256 bit descriptor of a region: the region is split into a 16 x 16 grid and a bit is set
+    // when the cell is brighter than the whole region. The grid follows the region, so a template
+    // and a blob of a different size still compare. Meant for the binary otsu / opening output.
+    struct descriptor
+    {
+        uint64_t bits[4] = {0};
+
+        inline uint16_t part(int i) const { return uint16_t(bits[i / 4] >> (i % 4 * 16)); }
+        inline bool operator==(const descriptor& rhs) const { return memcmp(bits, rhs.bits, sizeof(bits)) == 0; }
+    };
+
+    inline int popcount(uint64_t x)
+    {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_popcountll(x);
+#else
+        int count = 0;
+        for (; x; x &= x - 1)
+            ++count;
+        return count;
+#endif
     }
 
-    // morphological
-    inline void erosion(mask& m)
+    inline int hamming_distance(const descriptor& a, const descriptor& b)
     {
-        void (*func)(pixels& op, pixel& np) = [](pixels& op, pixel& np)
+        return popcount(a.bits[0] ^ b.bits[0]) + popcount(a.bits[1] ^ b.bits[1]) + popcount(a.bits[2] ^ b.bits[2]) + popcount(a.bits[3] ^ b.bits[3]);
+    }
+
+    // describes [left, right) x [top, bottom) of an image, r channel or the single channel, the region must lie inside the image
+    inline descriptor describe(const uchar* image, int image_width, int channels, int left, int top, int right, int bottom)
+    {
+        constexpr int grid = 16;
+        descriptor d;
+        if (right <= left || bottom <= top)
+            return d;
+
+        const int w = right - left, h = bottom - top, offset = channels == 3 ? 2 : 0;
+        uint32_t sums[grid][grid];
+        uint32_t counts[grid][grid];
+        uint64_t total = 0, area = 0;
+
+        scratch_scope scope;
+        uint32_t* column = scratch_arena::local().allocate_array<uint32_t>(w);
+
+        // cells of regions smaller than the grid share pixels, so every cell has at least one
+        for (int cy = 0; cy < grid; ++cy)
         {
-            constexpr int filter[3][3] = {{  1,  1,  1},
-                                          {  1,  1,  1},
-                                          {  1,  1,  1}};
-            int value = 255;
-            for (int row = -1; row < 2; row++)
-                for (int col = -1; col < 2; col++)
+            const int y0 = cy * h / grid, y1 = std::max(y0 + 1, (cy + 1) * h / grid);
+            memset(column, 0, sizeof(uint32_t) * w);
+            for (int y = y0; y < y1; ++y)
+            {
+                const uchar* row = image + (size_t(top + y) * image_width + left) * channels + offset;
+                for (int x = 0; x < w; ++x)
+                    column[x] += row[x * channels];
+            }
+
+            for (int cx = 0; cx < grid; ++cx)
+            {
+                const int x0 = cx * w / grid, x1 = std::max(x0 + 1, (cx + 1) * w / grid);
+                uint32_t sum = 0;
+                for (int x = x0; x < x1; ++x)
+                    sum += column[x];
+                sums[cy][cx] = sum;
+                counts[cy][cx] = uint32_t(x1 - x0) * (y1 - y0);
+                total += sum;
+                area += counts[cy][cx];
+            }
+        }
+
+        for (int cy = 0; cy < grid; ++cy)
+            for (int cx = 0; cx < grid; ++cx)
+                if (uint64_t(sums[cy][cx]) * area > total * counts[cy][cx])
                 {
-                    const pixel& p = op.at(row, col);
-                    if (filter[row+1][col+1] == 1) 
-                        if (p.r != 255)
-                            value = 0;
+                    int bit = cy * grid + cx;
+                    d.bits[bit / 64] |= uint64_t(1) << (bit % 64);
                 }
-            np = value;
-        };
-
-        m.operate(func);
+        return d;
     }
 
-    inline void dilation(mask& m)
+    // Multi index hashing over Hamming space. Descriptors are cut into 16 parts of 16 bits, every part has
+    // its own table. A descriptor within distance r of the query has at least one part within r / 16 of the
+    // query part, so probing every table up to that radius finds all of them without scanning the index.
+    class descriptor_index
     {
-        void (*func)(pixels& op, pixel& np) = [](pixels& op, pixel& np)
+    private:
+        constexpr static int part_count = 16;
+        constexpr static int part_keys = 1 << 16;
+
+        std::vector<descriptor> m_descriptors;
+        std::vector<int> m_labels;
+        // per part: entries of key k are m_entries[part][m_offsets[part][k] .. m_offsets[part][k + 1])
+        std::vector<uint32_t> m_offsets;
+        std::vector<uint32_t> m_entries;
+        bool m_built = false;
+
+        inline const uint32_t* offsets(int part) const { return m_offsets.data() + size_t(part) * (part_keys + 1); }
+        inline const uint32_t* entries(int part) const { return m_entries.data() + size_t(part) * m_descriptors.size(); }
+
+        // calls visit for every entry whose part i is within part_radius of the query part i, entries may repeat
+        template <typename visit_function>
+        inline void probe(const descriptor& query, int part_radius, visit_function visit) const
         {
-            constexpr int filter[3][3] = {{  1,  1,  1},
-                                          {  1,  1,  1},
-                                          {  1,  1,  1}};
-            int value = 0;
-            for (int row = -1; row < 2; row++)
-                for (int col = -1; col < 2; col++)
+            for (int i = 0; i < part_count; ++i)
+            {
+                const uint32_t* o = offsets(i);
+                const uint32_t* e = entries(i);
+                auto bucket = [&](uint16_t key)
                 {
-                    const pixel& p = op.at(row, col);
-                    if (filter[row+1][col+1] == 1)
-                        if (p.r == 255)
-                            value = 255;
+                    for (uint32_t j = o[key]; j < o[key + 1]; ++j)
+                        visit(e[j]);
+                };
+
+                uint16_t key = query.part(i);
+                bucket(key);
+                for (int a = 0; a < 16 && part_radius >= 1; ++a)
+                {
+                    bucket(uint16_t(key ^ (1 << a)));
+                    for (int b = a + 1; b < 16 && part_radius >= 2; ++b)
+                        bucket(uint16_t(key ^ (1 << a) ^ (1 << b)));
                 }
-            np = value;
+            }
+        }
+
+    public:
+        // probing costs grow quickly with the part radius, 2 covers distances up to 47
+        constexpr static int maximum_radius = part_count * 3 - 1;
+
+        struct match
+        {
+            int entry;
+            int label;
+            int distance;
         };
 
-        m.operate(func);
+        // label is returned with the matches, e.g. the template the descriptor was taken from
+        inline int add(const descriptor& d, int label)
+        {
+            m_descriptors.push_back(d);
+            m_labels.push_back(label);
+            m_built = false;
+            return int(m_descriptors.size()) - 1;
+        }
+
+        inline void clear()
+        {
+            m_descriptors.clear();
+            m_labels.clear();
+            m_offsets.clear();
+            m_entries.clear();
+            m_built = false;
+        }
+
+        inline size_t size() const { return m_descriptors.size(); }
+        inline const descriptor& get(int entry) const { return m_descriptors[entry]; }
+        inline int label(int entry) const { return m_labels[entry]; }
+
+        // counting sort of every part, called once after adding and before searching
+        inline void build()
+        {
+            const size_t n = m_descriptors.size();
+            m_offsets.assign(size_t(part_count) * (part_keys + 1), 0);
+            m_entries.resize(n * part_count);
+
+            for (int i = 0; i < part_count; ++i)
+            {
+                uint32_t* o = m_offsets.data() + size_t(i) * (part_keys + 1);
+                uint32_t* e = m_entries.data() + size_t(i) * n;
+                for (size_t j = 0; j < n; ++j)
+                    o[m_descriptors[j].part(i) + 1]++;
+                for (int k = 0; k < part_keys; ++k)
+                    o[k + 1] += o[k];
+                for (size_t j = 0; j < n; ++j)
+                    e[o[m_descriptors[j].part(i)]++] = uint32_t(j);
+                // the fill moved every offset one bucket ahead
+                memmove(o + 1, o, sizeof(uint32_t) * part_keys);
+                o[0] = 0;
+            }
+            m_built = true;
+        }
+
+        // every entry within radius of the query, nearest first
+        inline std::vector<match> search(const descriptor& query, int radius) const
+        {
+            std::vector<match> matches;
+            if (!m_built || m_descriptors.empty())
+                return matches;
+            radius = std::min(radius, maximum_radius);
+
+            scratch_scope scope;
+            uint64_t* seen = scratch_arena::local().allocate_array<uint64_t>((m_descriptors.size() + 63) / 64);
+            memset(seen, 0, sizeof(uint64_t) * ((m_descriptors.size() + 63) / 64));
+
+            probe(query, radius / part_count, [&](uint32_t entry)
+            {
+                if (seen[entry / 64] & (uint64_t(1) << (entry % 64)))
+                    return;
+                seen[entry / 64] |= uint64_t(1) << (entry % 64);
+                int distance = hamming_distance(query, m_descriptors[entry]);
+                if (distance <= radius)
+                    matches.push_back({ int(entry), m_labels[entry], distance });
+            });
+
+            std::sort(matches.begin(), matches.end(), [](const match& a, const match& b) { return a.distance < b.distance || (a.distance == b.distance && a.entry < b.entry); });
+            return matches;
+        }
+
+        // nearest entry within radius, entry is -1 when there is none
+        inline match nearest(const descriptor& query, int radius = maximum_radius) const
+        {
+            radius = std::min(radius, maximum_radius);
+            for (int covered = part_count - 1; ; covered += part_count)
+            {
+                std::vector<match> matches = search(query, std::min(covered, radius));
+                if (!matches.empty())
+                    return matches.front();
+                if (covered >= radius)
+                    return { -1, -1, 0 };
+            }
+        }
+
+        // one vote per query descriptor for the label of its nearest entry, votes[label] must be zeroed by the caller
+        inline void vote(const descriptor* queries, int count, int radius, int* votes) const
+        {
+            for (int i = 0; i < count; ++i)
+            {
+                match m = nearest(queries[i], radius);
+                if (m.entry >= 0)
+                    votes[m.label]++;
+            }
+        }
+    };
+
+    // Descriptors of every component, e.g. the blobs from connected_components, plus their union when whole is set.
+    // The image is read in place, the components are shared by m.get_thread_count() + 1 parallel_for chunks.
+    inline std::vector<descriptor> describe_components(mask& m, const std::vector<component>& components, bool whole = false)
+    {
+        PPFIS_TRACE_SCOPE("describe_components");
+
+        std::vector<component> regions = components;
+        if (whole && !regions.empty())
+        {
+            component all = regions.front();
+            for (const component& c : regions)
+            {
+                all.left = std::min(all.left, c.left);
+                all.top = std::min(all.top, c.top);
+                all.right = std::max(all.right, c.right);
+                all.bottom = std::max(all.bottom, c.bottom);
+            }
+            regions.push_back(all);
+        }
+
+        std::vector<descriptor> descriptors(regions.size());
+        if (regions.empty() || !m.get_image())
+            return descriptors;
+
+        struct work
+        {
+            const uchar* image;
+            int image_width, channels;
+            const component* regions;
+            descriptor* descriptors;
+        } w = { m.get_image(), m.get_image_width(), m.get_channels(), regions.data(), descriptors.data() };
+
+        void (*func)(int, work*) = [](int i, work* w)
+        {
+            const component& r = w->regions[i];
+            w->descriptors[i] = describe(w->image, w->image_width, w->channels, r.left, r.top, r.right, r.bottom);
+        };
+        parallel_for(0, int(regions.size()), m.get_thread_count() + 1, func, &w);
+        return descriptors;
     }
 
-    inline void opening(mask& m)
+    // raw frame container ===
+    // 64 byte header followed by the pixel data, memory mapped so a mask can work on the file pages directly.
+    enum class raw_format : uint32_t
     {
-        erosion(m);
-        dilation(m);
+        interleaved = 0, // packed BGR (3 channels) or 8-bit gray (1 channel), row major
+        planar = 1,      // one 8-bit plane per channel
+        binary = 2       // 1 bit per pixel, most significant bit first, rows padded to a byte
+    };
+
+    struct raw_header
+    {
+        char magic[4];       // "PPFR"
+        uint32_t version;
+        uint32_t width;
+        uint32_t height;
+        uint32_t channels;
+        raw_format format;
+        uint64_t data_size;
+        uint8_t reserved[32];
+    };
+    static_assert(sizeof(raw_header) == 64, "raw_header must stay 64 bytes");
+
+    // 0 for dimensions a mask cannot address, an unknown format, or a size that does not fit in size_t
+    inline size_t raw_data_size(uint32_t width, uint32_t height, uint32_t channels, raw_format format)
+    {
+        if (width == 0 || height == 0 || width > INT_MAX || height > INT_MAX || (channels != 1 && channels != 3))
+            return 0;
+
+        size_t row;
+        switch (format)
+        {
+            case raw_format::interleaved:
+            case raw_format::planar:      row = size_t(width) * channels; break;
+            case raw_format::binary:      row = (size_t(width) + 7) / 8; break;
+            default:                      return 0;
+        }
+        if (row > SIZE_MAX / height)
+            return 0;
+        return row * height;
     }
 
-    inline void closing(mask& m)
+    class raw_image
     {
-        dilation(m);
-        erosion(m);
+    private:
+        int m_file = -1;
+        uchar* m_map = nullptr;
+        size_t m_map_size = 0;
+        raw_header* m_header = nullptr;
+        uchar* m_planes[3] = { nullptr };
+
+        inline bool map(int protection, int flags)
+        {
+            struct stat st;
+            if (fstat(m_file, &st) || size_t(st.st_size) < sizeof(raw_header))
+                return false;
+
+            m_map_size = st.st_size;
+            void* map = mmap(nullptr, m_map_size, protection, flags, m_file, 0);
+            if (map == MAP_FAILED)
+                return false;
+            m_map = reinterpret_cast<uchar*>(map);
+            m_header = reinterpret_cast<raw_header*>(m_map);
+
+            // data_size is compared against what is left of the mapping, adding to it could wrap
+            size_t data_size = raw_data_size(m_header->width, m_header->height, m_header->channels, m_header->format);
+            if (memcmp(m_header->magic, "PPFR", 4) || m_header->version != 1 ||
+                data_size == 0 || m_header->data_size != data_size ||
+                data_size > m_map_size - sizeof(raw_header))
+                return false;
+
+            size_t plane_size = m_header->format == raw_format::planar ? size_t(m_header->width) * m_header->height : 0;
+            for (int i = 0; i < 3; ++i)
+                m_planes[i] = m_map + sizeof(raw_header) + plane_size * i;
+            return true;
+        }
+
+    public:
+        inline raw_image() {}
+        inline ~raw_image() { close(); }
+        raw_image(const raw_image&) = delete;
+        raw_image& operator=(const raw_image&) = delete;
+
+        // shared maps write straight into the file, otherwise pages are copied on write and the file is left untouched
+        inline bool open(const char* path, bool shared = false)
+        {
+            close();
+            m_file = ::open(path, shared ? O_RDWR : O_RDONLY);
+            if (m_file < 0 || !map(PROT_READ | PROT_WRITE, shared ? MAP_SHARED : MAP_PRIVATE))
+            {
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        // creates (or truncates) the file and maps it shared, pixel data starts zeroed
+        inline bool create(const char* path, int width, int height, int channels, raw_format format = raw_format::interleaved)
+        {
+            close();
+            size_t data_size = width > 0 && height > 0 ? raw_data_size(width, height, channels, format) : 0;
+            if (data_size == 0 || data_size > size_t(std::numeric_limits<off_t>::max()) - sizeof(raw_header))
+                return false;
+
+            raw_header header = {};
+            memcpy(header.magic, "PPFR", 4);
+            header.version = 1;
+            header.width = width;
+            header.height = height;
+            header.channels = channels;
+            header.format = format;
+            header.data_size = data_size;
+
+            m_file = ::open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+            if (m_file < 0 || ftruncate(m_file, sizeof(raw_header) + header.data_size) ||
+                pwrite(m_file, &header, sizeof(header), 0) != sizeof(header) ||
+                !map(PROT_READ | PROT_WRITE, MAP_SHARED))
+            {
+                close();
+                return false;
+            }
+            return true;
+        }
+
+        inline bool sync()
+        {
+            return m_map && msync(m_map, m_map_size, MS_SYNC) == 0;
+        }
+
+        inline void close()
+        {
+            if (m_map)
+                munmap(m_map, m_map_size);
+            if (m_file >= 0)
+                ::close(m_file);
+            m_file = -1;
+            m_map = nullptr;
+            m_map_size = 0;
+            m_header = nullptr;
+            m_planes[0] = m_planes[1] = m_planes[2] = nullptr;
+        }
+
+        inline bool is_open() const { return m_map != nullptr; }
+        inline int width() const { return m_header ? m_header->width : 0; }
+        inline int height() const { return m_header ? m_header->height : 0; }
+        inline int channels() const { return m_header ? m_header->channels : 0; }
+        inline raw_format format() const { return m_header ? m_header->format : raw_format::interleaved; }
+
+        // for mask wrapping, e.g. mask m(raw.image(), raw.height(), raw.width(), raw.channels());
+        inline uchar** image() { return &m_planes[0]; }
+        // planar images wrap one plane per mask, e.g. mask m(raw.plane(1), raw.height(), raw.width(), 1);
+        inline uchar** plane(int index) { return &m_planes[std::max(0, std::min(2, index))]; }
+    };
+
+    // binary images are 0 / 255, any non zero first channel value is packed as 1
+    inline void pack_binary(const uchar* image, int width, int height, int channels, uchar* bits)
+    {
+        const int row_bytes = (width + 7) / 8;
+        for (int y = 0; y < height; ++y)
+        {
+            const uchar* in = image + size_t(y) * width * channels;
+            uchar* out = bits + size_t(y) * row_bytes;
+            memset(out, 0, row_bytes);
+            for (int x = 0; x < width; ++x)
+                if (in[x * channels])
+                    out[x >> 3] |= uchar(0x80 >> (x & 7));
+        }
+    }
+
+    inline void unpack_binary(const uchar* bits, int width, int height, int channels, uchar* image)
+    {
+        const int row_bytes = (width + 7) / 8;
+        for (int y = 0; y < height; ++y)
+        {
+            const uchar* in = bits + size_t(y) * row_bytes;
+            uchar* out = image + size_t(y) * width * channels;
+            for (int x = 0; x < width; ++x)
+            {
+                uchar v = (in[x >> 3] & (0x80 >> (x & 7))) ? 255 : 0;
+                for (int c = 0; c < channels; ++c)
+                    out[x * channels + c] = v;
+            }
+        }
     }
 }
@@ -8,6 +8,8 @@
 #include <opencv2/imgcodecs.hpp>
 #include <opencv2/video/tracking.hpp>
 
+#include "ppfis.h"
+
 
 typedef struct {
 	cv::Point matchLoc;
@@ -16,5 +18,21 @@ typedef struct {
 	int index;
 }RE_Matching;
 
-RE_Matching ROI_Temp_img(cv::Mat img, cv::Mat templ);
-void Image_Processing(cv::Mat & temp1_T, float gamma);
\ No newline at end of file
+// cv::Mat over arena memory, valid until the arena is reset
+cv::Mat scratch_mat(ppfis::scratch_arena& arena, int rows, int cols, int type);
+
+// scratch cv::Mats are drawn from arena and rewound on return, re_temp owns its data
+RE_Matching ROI_Temp_img(cv::Mat img, cv::Mat templ, ppfis::scratch_arena& arena = ppfis::scratch_arena::local());
+// searches only around blobs of the processed img, e.g. from ppfis::connected_components
+RE_Matching ROI_Temp_img(cv::Mat img, cv::Mat templ, const std::vector<ppfis::component>& blobs, ppfis::scratch_arena& arena = ppfis::scratch_arena::local());
+// every template against one img, the scaled images are shared and thread_count scheduler tasks help the calling thread
+std::vector<RE_Matching> ROI_Temp_img(cv::Mat img, const std::vector<cv::Mat>& templs, int thread_count = 0, ppfis::scratch_arena& arena = ppfis::scratch_arena::local());
+std::vector<RE_Matching> ROI_Temp_img(cv::Mat img, const std::vector<cv::Mat>& templs, const std::vector<ppfis::component>& blobs, int thread_count = 0, ppfis::scratch_arena& arena = ppfis::scratch_arena::local());
+// descriptors of the processed templates, searched by shortlist_templates
+void index_templates(const std::vector<cv::Mat>& templs, ppfis::descriptor_index& index);
+// indices of the templates that look like a blob of the processed img, every template when none does
+std::vector<int> shortlist_templates(cv::Mat img, const std::vector<ppfis::component>& blobs, const ppfis::descriptor_index& index, int radius = ppfis::descriptor_index::maximum_radius, ppfis::scratch_arena& arena = ppfis::scratch_arena::local());
+void Image_Processing(cv::Mat & temp1_T, float gamma);
+// Image_Processing on a continuous copy of roi drawn from arena, valid until the arena is reset
+cv::Mat ROI_Image_Processing(const cv::Mat& frame, cv::Rect roi, float gamma, ppfis::scratch_arena& arena = ppfis::scratch_arena::local());
+void Image_Processing_Local(cv::Mat & temp1_T, int window = 31);
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include "ROI_img.h"
 #include "ppfis.h"
+#include <atomic>
 using namespace std;
 
 RE_Matching func(cv::Point matchLoc, cv::Mat temp, double Max_Score, int index) {
@@ -11,19 +12,71 @@ RE_Matching func(cv::Point matchLoc, cv::Mat temp, double Max_Score, int index)
 	return Matching;
 }
 
+// OpenCV writes into the arena memory as long as the size and type match
+cv::Mat scratch_mat(ppfis::scratch_arena& arena, int rows, int cols, int type)
+{
+	return cv::Mat(rows, cols, type, arena.allocate(size_t(rows) * cols * CV_ELEM_SIZE(type)));
+}
+
+// same size resize computes for cv::Size() and a scale
+cv::Mat scratch_resized(ppfis::scratch_arena& arena, const cv::Mat& src, double scale)
+{
+	return scratch_mat(arena, cv::saturate_cast<int>(src.rows * scale), cv::saturate_cast<int>(src.cols * scale), src.type());
+}
+
+cv::Mat scratch_result(ppfis::scratch_arena& arena, const cv::Mat& img, const cv::Mat& templ)
+{
+	return scratch_mat(arena, std::max(img.rows - templ.rows + 1, 1), std::max(img.cols - templ.cols + 1, 1), CV_32F);
+}
+
+// the scales every search tries, the factors mapping a match back to the ROI and the returned template scales
+const double match_scales[5] = { 1.05, 1.00, 0.95, 0.90, 0.85 };
+const double match_back_factors[5] = { 0.95, 1.00, 1.05, 1.10, 1.15 };
+const double match_template_scales[5] = { 0.95, 1.00, 1.05, 1.10, 1.15 };
+
+// Every needed scale of img in one ppfis pass over img, scaled[i] stays empty when needed[i] is false.
+// Bilinear like cv::resize, pixel values may differ from it by one.
+void scale_levels(ppfis::scratch_arena& arena, cv::Mat img, const bool* needed, cv::Mat* scaled)
+{
+	// mask expects continuous rows
+	if (!img.isContinuous())
+	{
+		cv::Mat copy = scratch_mat(arena, img.rows, img.cols, img.type());
+		img.copyTo(copy);
+		img = copy;
+	}
+
+	ppfis::scale_level levels[5];
+	int count = 0;
+	for (int i = 0; i < 5; ++i)
+		if (needed[i])
+		{
+			scaled[i] = scratch_resized(arena, img, match_scales[i]);
+			levels[count++] = { match_scales[i], scaled[i].data, 0, 0 };
+		}
+
+	ppfis::mask m(&img.data, img.rows, img.cols, img.channels());
+	m.set_thread_count(3); // bands share the ppfis scheduler with the ROI tasks
+	ppfis::resize_levels(m, levels, count);
+}
+
 // Original template Matching
-RE_Matching ROI_Temp_img(cv::Mat img, cv::Mat templ)
+RE_Matching ROI_Temp_img(cv::Mat img, cv::Mat templ, ppfis::scratch_arena& arena)
 {
-	cv::Mat img_1, img_2, img_3, img_4, img_5;
-	cv::Mat templ_1, templ_2, templ_3, templ_4, templ_5;
-	cv::Mat Temp_T = templ.clone();
-	cv::Mat result_1, result_2, result_3, result_4, result_5;
+	ppfis::scratch_scope scope(arena);
+	// matchTemplate does not modify the template, no copy needed
+	cv::Mat& Temp_T = templ;
+	// all five scales in one pass
+	const bool all_scales[5] = { true, true, true, true, true };
+	cv::Mat img_levels[5];
+	scale_levels(arena, img, all_scales, img_levels);
+	cv::Mat& img_1 = img_levels[0], & img_2 = img_levels[1], & img_3 = img_levels[2], & img_4 = img_levels[3], & img_5 = img_levels[4];
+	cv::Mat result_1 = scratch_result(arena, img_1, Temp_T), result_2 = scratch_result(arena, img_2, Temp_T), result_3 = scratch_result(arena, img_3, Temp_T), result_4 = scratch_result(arena, img_4, Temp_T), result_5 = scratch_result(arena, img_5, Temp_T);
 	RE_Matching Matching;
 	double minVal; double maxVal = 0;
 	cv::Point minLoc(-1, -1); cv::Point maxLoc(-1, -1);
 
 	// ROI 105%
-	resize(img, img_1, cv::Size(), 1.05, 1.05);
 	matchTemplate(img_1, Temp_T, result_1, cv::TM_CCORR_NORMED);
 	minMaxLoc(result_1, &minVal, &maxVal, &minLoc, &maxLoc, cv::Mat());
 	cv::Point matchLoc_1;
@@ -34,7 +87,6 @@ RE_Matching ROI_Temp_img(cv::Mat img, cv::Mat templ)
 	double min_scores_1 = 100 * (1 - minVal);
 	
 	// ROI 100%
-	resize(img, img_2, cv::Size(), 1.00, 1.00);
 	matchTemplate(img_2, Temp_T, result_2, cv::TM_CCORR_NORMED);
 	minMaxLoc(result_2, &minVal, &maxVal, &minLoc, &maxLoc, cv::Mat()); 
 	cv::Point matchLoc_2;
@@ -45,7 +97,6 @@ RE_Matching ROI_Temp_img(cv::Mat img, cv::Mat templ)
 	double min_scores_2 = 100 * (1 - minVal);
 
 	// ROI 95%
-	resize(img, img_3, cv::Size(), 0.95, 0.95);
 	matchTemplate(img_3, Temp_T, result_3, cv::TM_CCORR_NORMED);
 	minMaxLoc(result_3, &minVal, &maxVal, &minLoc, &maxLoc, cv::Mat());
 	cv::Point matchLoc_3;
@@ -56,7 +107,6 @@ RE_Matching ROI_Temp_img(cv::Mat img, cv::Mat templ)
 	double min_scores_3 = 100 * (1 - minVal);
 
 	// ROI 90%
-	resize(img, img_4, cv::Size(), 0.90, 0.90);
 	matchTemplate(img_4, Temp_T, result_4, cv::TM_CCORR_NORMED);
 	minMaxLoc(result_4, &minVal, &maxVal, &minLoc, &maxLoc, cv::Mat());
 	cv::Point matchLoc_4;
@@ -67,7 +117,6 @@ RE_Matching ROI_Temp_img(cv::Mat img, cv::Mat templ)
 	double min_scores_4 = 100 * (1 - minVal);
 
 	// ROI 85%
-	resize(img, img_5, cv::Size(), 0.85, 0.85);
 	matchTemplate(img_5, Temp_T, result_5, cv::TM_CCORR_NORMED);
 	minMaxLoc(result_5, &minVal, &maxVal, &minLoc, &maxLoc, cv::Mat());
 	cv::Point matchLoc_5;
@@ -77,12 +126,6 @@ RE_Matching ROI_Temp_img(cv::Mat img, cv::Mat templ)
 	double max_scores_5 = 100 * maxVal;
 	double min_scores_5 = 100 * (1 - minVal);
 
-	resize(Temp_T, templ_1, cv::Size(), 0.95, 0.95);
-	resize(Temp_T, templ_2, cv::Size(), 1.00, 1.00);
-	resize(Temp_T, templ_3, cv::Size(), 1.05, 1.05);
-	resize(Temp_T, templ_4, cv::Size(), 1.10, 1.10);
-	resize(Temp_T, templ_5, cv::Size(), 1.15, 1.15);
-
 	// only output MAX values
 	std::vector<double> vi{ max_scores_1, max_scores_2, max_scores_3, max_scores_4, max_scores_5 };
 	double Max_Temp = *max_element(vi.begin(), vi.end());
@@ -90,39 +133,322 @@ RE_Matching ROI_Temp_img(cv::Mat img, cv::Mat templ)
 
 	if (Max_Temp == max_scores_1)
 	{
+		// only the returned template scale is resized
+		cv::Mat templ_1;
+		resize(Temp_T, templ_1, cv::Size(), 0.95, 0.95);
 		RE_Matching Matching = func(matchLoc_1, templ_1, max_scores_1, 1);
 		return Matching;
 	}
 	else if (Max_Temp == max_scores_2) 
 	{
+		// only the returned template scale is resized
+		cv::Mat templ_2;
+		resize(Temp_T, templ_2, cv::Size(), 1.00, 1.00);
 		RE_Matching Matching = func(matchLoc_2, templ_2, max_scores_2,2);
 		return Matching;
 	}
 	else if (Max_Temp == max_scores_3) 
 	{
+		// only the returned template scale is resized
+		cv::Mat templ_3;
+		resize(Temp_T, templ_3, cv::Size(), 1.05, 1.05);
 		RE_Matching Matching = func(matchLoc_3, templ_3, max_scores_3,3);
 		return Matching;
 	}
 	else if (Max_Temp == max_scores_4)
 	{
+		// only the returned template scale is resized
+		cv::Mat templ_4;
+		resize(Temp_T, templ_4, cv::Size(), 1.10, 1.10);
 		RE_Matching Matching = func(matchLoc_4, templ_4, max_scores_4,4);
 		return Matching;
 	}
 	else if (Max_Temp == max_scores_5)
 	{
+		// only the returned template scale is resized
+		cv::Mat templ_5;
+		resize(Temp_T, templ_5, cv::Size(), 1.15, 1.15);
 		RE_Matching Matching = func(matchLoc_5, templ_5, max_scores_5,5);
 		return Matching;
 	}
 
 }
 
+// Window of the scaled image holding every template placement that overlaps the blob.
+// False when the blob does not fit the template at this scale or no placement is left.
+bool candidate_window(const ppfis::component& blob, double scale, cv::Size templ, cv::Size scaled, cv::Rect& window)
+{
+	constexpr double smallest_blob = 0.25, largest_blob = 1.1;
+
+	double blob_width = (blob.right - blob.left) * scale, blob_height = (blob.bottom - blob.top) * scale;
+	if (blob_width < smallest_blob * templ.width || blob_width > largest_blob * templ.width ||
+		blob_height < smallest_blob * templ.height || blob_height > largest_blob * templ.height)
+		return false;
+
+	// template positions overlapping the blob, clamped to the positions inside the image
+	int x0 = std::max(0, int(blob.left * scale) - templ.width + 1), y0 = std::max(0, int(blob.top * scale) - templ.height + 1);
+	int x1 = std::min(scaled.width - templ.width, int(ceil(blob.right * scale)) - 1), y1 = std::min(scaled.height - templ.height, int(ceil(blob.bottom * scale)) - 1);
+	if (x1 < x0 || y1 < y0)
+		return false;
+
+	window = cv::Rect(x0, y0, x1 - x0 + templ.width, y1 - y0 + templ.height);
+	return true;
+}
+
+// Template matching restricted to connected components of the processed ROI.
+// A blob is a candidate at a scale when its scaled size fits the template, and only the placements
+// of the template that overlap the blob are correlated. Without any candidate the full search runs.
+RE_Matching ROI_Temp_img(cv::Mat img, cv::Mat templ, const std::vector<ppfis::component>& blobs, ppfis::scratch_arena& arena)
+{
+	ppfis::scratch_scope scope(arena);
+	double max_score = -1;
+	cv::Point best_loc(-1, -1);
+	int best = -1;
+
+	// the scaled images are only made for scales that have a candidate
+	bool needed[5] = { false };
+	bool any = false;
+	for (int i = 0; i < 5; ++i)
+		for (const ppfis::component& blob : blobs)
+		{
+			cv::Size scaled_size(cv::saturate_cast<int>(img.cols * match_scales[i]), cv::saturate_cast<int>(img.rows * match_scales[i]));
+			cv::Rect window;
+			if (candidate_window(blob, match_scales[i], templ.size(), scaled_size, window))
+				needed[i] = any = true;
+		}
+	if (!any)
+		return ROI_Temp_img(img, templ, arena);
+
+	cv::Mat levels[5];
+	scale_levels(arena, img, needed, levels);
+
+	for (int i = 0; i < 5; ++i)
+	{
+		const cv::Mat& scaled = levels[i];
+		for (const ppfis::component& blob : blobs)
+		{
+			cv::Rect window;
+			if (!needed[i] || !candidate_window(blob, match_scales[i], templ.size(), scaled.size(), window))
+				continue;
+
+			cv::Mat result = scratch_result(arena, scaled(window), templ);
+			double maxVal = 0;
+			cv::Point maxLoc(-1, -1);
+			matchTemplate(scaled(window), templ, result, cv::TM_CCORR_NORMED);
+			minMaxLoc(result, nullptr, &maxVal, nullptr, &maxLoc, cv::Mat());
+
+			if (100 * maxVal > max_score)
+			{
+				max_score = 100 * maxVal;
+				best_loc = cv::Point(int((maxLoc.x + window.x) * match_back_factors[i]), int((maxLoc.y + window.y) * match_back_factors[i]));
+				best = i;
+			}
+		}
+	}
+
+	// every candidate window is at least one placement, but the full search stays the fallback
+	if (best < 0)
+		return ROI_Temp_img(img, templ, arena);
+
+	// re_temp outlives the scratch scope
+	cv::Mat re_templ;
+	resize(templ, re_templ, cv::Size(), match_template_scales[best], match_template_scales[best]);
+	return func(best_loc, re_templ, max_score, best + 1);
+}
+
+// one matchTemplate call of the multi template search
+struct match_job
+{
+	int templ;
+	int scale;
+	cv::Rect window;  // in the scaled image
+	double max_score;
+	cv::Point max_loc;  // in the scaled image
+};
+
+struct match_work
+{
+	const std::vector<cv::Mat>* templs;
+	cv::Mat scaled[5];
+	std::vector<match_job> jobs;
+	std::atomic<size_t> next_job{0};
+};
+
+// one puller of jobs, result_buffer holds the largest result of any job
+struct match_task
+{
+	match_work* work;
+	float* result_buffer;
+};
+
+// jobs are pulled until none are left
+void match_worker(match_task* task)
+{
+	match_work* work = task->work;
+	float* result_buffer = task->result_buffer;
+	size_t index;
+	while ((index = work->next_job++) < work->jobs.size())
+	{
+		match_job& job = work->jobs[index];
+		const cv::Mat& templ = (*work->templs)[job.templ];
+		cv::Mat window = work->scaled[job.scale](job.window);
+		cv::Mat result(window.rows - templ.rows + 1, window.cols - templ.cols + 1, CV_32F, result_buffer);
+		double maxVal = 0;
+		cv::Point maxLoc(-1, -1);
+		matchTemplate(window, templ, result, cv::TM_CCORR_NORMED);
+		minMaxLoc(result, nullptr, &maxVal, nullptr, &maxLoc, cv::Mat());
+		job.max_score = 100 * maxVal;
+		job.max_loc = cv::Point(maxLoc.x + job.window.x, maxLoc.y + job.window.y);
+	}
+}
+
+// Template matching of many templates against one processed ROI.
+// The five scaled images are made once and shared by every template. Each (template, scale) pair is cut into
+// tiles of result rows, or into the candidate windows of the blobs when blobs are given, and the tiles are
+// pulled by thread_count tasks on the shared ppfis scheduler plus the calling thread. Results are the same as one ROI_Temp_img per template.
+std::vector<RE_Matching> match_templates(cv::Mat img, const std::vector<cv::Mat>& templs, const std::vector<ppfis::component>* blobs, int thread_count, ppfis::scratch_arena& arena)
+{
+	constexpr int maximum_thread_count = 16;
+	constexpr int tile_rows = 64;
+	ppfis::scratch_scope scope(arena);
+
+	match_work work;
+	work.templs = &templs;
+	bool scale_used[5] = { false };
+
+	for (int t = 0; t < int(templs.size()); ++t)
+	{
+		const cv::Mat& templ = templs[t];
+		size_t first_job = work.jobs.size();
+
+		if (blobs)
+			for (int i = 0; i < 5; ++i)
+				for (const ppfis::component& blob : *blobs)
+				{
+					cv::Size scaled_size(cv::saturate_cast<int>(img.cols * match_scales[i]), cv::saturate_cast<int>(img.rows * match_scales[i]));
+					cv::Rect window;
+					if (candidate_window(blob, match_scales[i], templ.size(), scaled_size, window))
+						work.jobs.push_back({ t, i, window, -1, cv::Point(-1, -1) });
+				}
+
+		// no blobs or no candidate: every placement, in tiles of result rows
+		if (work.jobs.size() == first_job)
+			for (int i = 0; i < 5; ++i)
+			{
+				cv::Size scaled_size(cv::saturate_cast<int>(img.cols * match_scales[i]), cv::saturate_cast<int>(img.rows * match_scales[i]));
+				if (scaled_size.width < templ.cols || scaled_size.height < templ.rows)
+					continue;
+				int result_rows = scaled_size.height - templ.rows + 1;
+				for (int y = 0; y < result_rows; y += tile_rows)
+					work.jobs.push_back({ t, i, cv::Rect(0, y, scaled_size.width, std::min(tile_rows, result_rows - y) + templ.rows - 1), -1, cv::Point(-1, -1) });
+			}
+	}
+
+	size_t result_size = 1;
+	for (const match_job& job : work.jobs)
+	{
+		scale_used[job.scale] = true;
+		result_size = std::max(result_size, size_t(job.window.width - templs[job.templ].cols + 1) * (job.window.height - templs[job.templ].rows + 1));
+	}
+
+	scale_levels(arena, img, scale_used, work.scaled);
+
+	// a result buffer per task, drawn before any task runs
+	thread_count = std::max(0, std::min(maximum_thread_count, std::min(thread_count, int(work.jobs.size()) - 1)));
+	match_task tasks[maximum_thread_count + 1];
+	for (int i = 0; i <= thread_count; ++i)
+		tasks[i] = { &work, arena.allocate_array<float>(result_size) };
+
+	ppfis::task_group group;
+	for (int i = 0; i < thread_count; ++i)
+		group.run(match_worker, &tasks[i]);
+	match_worker(&tasks[thread_count]);
+	group.wait();
+
+	// jobs are in scale order per template and tiles in row order, so the first maximum wins like in ROI_Temp_img
+	std::vector<RE_Matching> matchings(templs.size());
+	std::vector<const match_job*> best(templs.size(), nullptr);
+	for (const match_job& job : work.jobs)
+		if (!best[job.templ] || job.max_score > best[job.templ]->max_score)
+			best[job.templ] = &job;
+
+	for (size_t t = 0; t < templs.size(); ++t)
+	{
+		if (!best[t])
+		{
+			matchings[t] = func(cv::Point(-1, -1), templs[t], 0, 0);
+			continue;
+		}
+		const match_job& job = *best[t];
+		cv::Mat re_templ;
+		resize(templs[t], re_templ, cv::Size(), match_template_scales[job.scale], match_template_scales[job.scale]);
+		cv::Point loc(int(job.max_loc.x * match_back_factors[job.scale]), int(job.max_loc.y * match_back_factors[job.scale]));
+		matchings[t] = func(loc, re_templ, job.max_score, job.scale + 1);
+	}
+	return matchings;
+}
+
+std::vector<RE_Matching> ROI_Temp_img(cv::Mat img, const std::vector<cv::Mat>& templs, int thread_count, ppfis::scratch_arena& arena)
+{
+	return match_templates(img, templs, nullptr, thread_count, arena);
+}
+
+std::vector<RE_Matching> ROI_Temp_img(cv::Mat img, const std::vector<cv::Mat>& templs, const std::vector<ppfis::component>& blobs, int thread_count, ppfis::scratch_arena& arena)
+{
+	return match_templates(img, templs, &blobs, thread_count, arena);
+}
+
+// one descriptor of every whole processed template, labelled with its index in templs
+void index_templates(const std::vector<cv::Mat>& templs, ppfis::descriptor_index& index)
+{
+	index.clear();
+	for (int t = 0; t < int(templs.size()); ++t)
+	{
+		// describe reads continuous rows
+		cv::Mat templ = templs[t].isContinuous() ? templs[t] : templs[t].clone();
+		index.add(ppfis::describe(templ.data, templ.cols, templ.channels(), 0, 0, templ.cols, templ.rows), t);
+	}
+	index.build();
+}
+
+// Templates with a blob of the processed img within radius of their descriptor, in template order.
+// Every template when no blob is near any of them, so the search never gets fewer templates than without the index.
+std::vector<int> shortlist_templates(cv::Mat img, const std::vector<ppfis::component>& blobs, const ppfis::descriptor_index& index, int radius, ppfis::scratch_arena& arena)
+{
+	ppfis::scratch_scope scope(arena);
+	// mask expects continuous rows
+	if (!img.isContinuous())
+	{
+		cv::Mat copy = scratch_mat(arena, img.rows, img.cols, img.type());
+		img.copyTo(copy);
+		img = copy;
+	}
+
+	ppfis::mask m(&img.data, img.rows, img.cols, img.channels());
+	m.set_thread_count(3); // bands share the ppfis scheduler with the ROI tasks
+	std::vector<bool> listed(index.size(), false);
+	for (const ppfis::descriptor& d : ppfis::describe_components(m, blobs))
+		for (const ppfis::descriptor_index::match& match : index.search(d, radius))
+			listed[match.label] = true;
+
+	std::vector<int> shortlist;
+	for (int t = 0; t < int(listed.size()); ++t)
+		if (listed[t])
+			shortlist.push_back(t);
+	if (shortlist.empty())
+		for (int t = 0; t < int(listed.size()); ++t)
+			shortlist.push_back(t);
+	return shortlist;
+}
+
 // Image_Processing (Gray + LUT(Brightness) + OTSU_Threshold + Opening_Filter)
 void Image_Processing(cv::Mat & temp1_T, float gamma)
 {
 	using namespace ppfis;
+	PPFIS_TRACE_SCOPE("Image_Processing");
 
 	mask m(&temp1_T.data, temp1_T.rows, temp1_T.cols);
-	m.set_thread_count(0); //run on no thread
+	m.set_thread_count(3); // bands share the ppfis scheduler with the ROI tasks
 
 	// Gray Image
 	grayscale(m);
@@ -136,13 +462,25 @@ void Image_Processing(cv::Mat & temp1_T, float gamma)
 		p.g = std::min(p.g + brightness, 255);
 		p.b = std::min(p.b + brightness, 255);
 	};
-	m.operate(brightness_func);
+	{
+		PPFIS_TRACE_SCOPE("brightness");
+		m.operate(brightness_func);
+	}
 
-	cv::Mat lookUpTable(1, 256, CV_8U);
-	uchar* p = lookUpTable.ptr();
-	for (int i = 0; i < 256; ++i)
-		p[i] = cv::saturate_cast<uchar>(pow(i / 255.0, gamma) * 255.0); // generting this lookup table every time seems redundant!
-	LUT(temp1_T, lookUpTable, temp1_T);
+	{
+		PPFIS_TRACE_SCOPE("gamma_lut");
+		// the table is only rebuilt when gamma changes
+		thread_local float table_gamma = -1;
+		thread_local uchar table[256];
+		if (table_gamma != gamma)
+		{
+			for (int i = 0; i < 256; ++i)
+				table[i] = cv::saturate_cast<uchar>(pow(i / 255.0, gamma) * 255.0);
+			table_gamma = gamma;
+		}
+		cv::Mat lookUpTable(1, 256, CV_8U, table);
+		LUT(temp1_T, lookUpTable, temp1_T);
+	}
 	
 	// OTSU_Threshold 
 	otsu_threshold(m);
@@ -150,3 +488,30 @@ void Image_Processing(cv::Mat & temp1_T, float gamma)
 	// Opening_Filtering
 	opening(m);
 }
+
+// ROI_Image_Processing (copy of the ROI + Image_Processing)
+// mask expects continuous rows, a view of the ROI would keep the row stride of the whole frame
+cv::Mat ROI_Image_Processing(const cv::Mat& frame, cv::Rect roi, float gamma, ppfis::scratch_arena& arena)
+{
+	cv::Mat roi_image = scratch_mat(arena, roi.height, roi.width, frame.type());
+	frame(roi).copyTo(roi_image);
+	Image_Processing(roi_image, gamma);
+	return roi_image;
+}
+
+// Image_Processing_Local (Sauvola local threshold + Opening_Filter)
+// gray conversion is fused into the threshold and uneven lighting needs no brightness / gamma pass
+void Image_Processing_Local(cv::Mat & temp1_T, int window)
+{
+	using namespace ppfis;
+	PPFIS_TRACE_SCOPE("Image_Processing_Local");
+
+	mask m(&temp1_T.data, temp1_T.rows, temp1_T.cols);
+	m.set_thread_count(3); // bands share the ppfis scheduler with the ROI tasks
+
+	// Local threshold
+	adaptive_threshold(m, window, local_threshold::sauvola);
+
+	// Opening_Filtering
+	opening(m);
+}
@@ -1,8 +1,10 @@
 #include "ROI_img.h"
 #include "ppfis.h"
+#include <fstream>
 
 // compile with:
 // g++ -pthread main.cpp -o run.exe $(pkg-config opencv --cflags --libs) -std=c++17
+// add -DPPFIS_TRACE to write per stage timing to trace.json
 
 #define gamma 3.0
 
@@ -18,12 +20,18 @@ int run_index = 0;
 Mat img;
 Mat img_display;
 
-// Templete_Image
+// Templete_Image, templ is the first of templs
 Mat templ;
+vector<Mat> templs;
+// descriptors of the processed templates, a ROI only matches the templates that look like one of its blobs
+descriptor_index templ_index;
 
 // Video Output
 VideoWriter Video_output;
 
+// scratch memory per ROI thread, kept across frames so steady state frames do not allocate
+scratch_arena roi_arenas[4];
+
 // Image Windows Name
 const char* image_window = "Source Image";
 const char* result_window = "Result window";
@@ -38,20 +46,26 @@ int main(int argc, char** argv)
 		return -1;
 	}
 
-	// Read template image
-	templ = imread("../../Data/Temp_img.jpg", IMREAD_COLOR);
-	if (templ.empty())
-	{
-		std::cout << "Can't read one of the images" << endl;
-		return -1;
-	}
+	// Read template images, further templates can be given as arguments
+	templs.push_back(imread("../../Data/Temp_img.jpg", IMREAD_COLOR));
+	for (int i = 1; i < argc; ++i)
+		templs.push_back(imread(argv[i], IMREAD_COLOR));
+	for (Mat& t : templs)
+		if (t.empty())
+		{
+			std::cout << "Can't read one of the images" << endl;
+			return -1;
+		}
 
 	// Video saving properties setup
 	Video_output.open("../../Data/Video_output.avi", VideoWriter::fourcc('D', 'I', 'V', 'X'), 10, Size(cap1.get(CAP_PROP_FRAME_WIDTH), cap1.get(CAP_PROP_FRAME_HEIGHT)));
 
 	///==========================================================================================
 	// Image_Processing( templete, output_templete, gamma) 
-	Image_Processing(templ, gamma);
+	for (Mat& t : templs)
+		Image_Processing(t, gamma);
+	templ = templs.front();
+	index_templates(templs, templ_index);
 	// Template processing part.
 	// Template color image with 4 steps (grayscaale -> brightness ->  OTSU_Threshold -> Opening_Filtering)
 	///==========================================================================================
@@ -75,16 +89,26 @@ int main(int argc, char** argv)
 		{
 			//Mat img_display;
 			img.copyTo(img_display);
-			simple_thread<4, int, int, int, int> t;
+			// ROIs run as tasks of the shared ppfis scheduler, so their operators can use bands without oversubscribing
+			task_group t;
+			struct roi_task
+			{
+				int left_x, left_y, right_x, right_y;
+				scratch_arena* arena;
+			};
 
-			void(*MatchingMethod)(int, int, int, int) = [](int ROI_LEFT_X, int ROI_LEFT_Y, int ROI_RIGHT_X, int ROI_RIGHT_Y)
+			void(*MatchingMethod)(roi_task*) = [](roi_task* task)
 			{
+				const int ROI_LEFT_X = task->left_x, ROI_LEFT_Y = task->left_y, ROI_RIGHT_X = task->right_x, ROI_RIGHT_Y = task->right_y;
+				scratch_arena* arena = task->arena;
+				// everything from the previous frame is released, ppfis operators draw from this arena as well
+				arena->reset();
+				scratch_binding binding(*arena);
+
 				Mat roiImg, Origin_img;
 				// copy image
 				//Mat img_display, 
-				Mat img_roi;
 				img.copyTo(img_display);
-				img.copyTo(img_roi);
 
 				int result_cols = img.cols - templ.cols + 1;
 				int result_rows = img.rows - templ.rows + 1;
@@ -93,52 +117,66 @@ int main(int argc, char** argv)
 
 				// Roi Point
 				Point Roi_point;
-				RE_Matching Temp_Loc_Max;
+				std::vector<RE_Matching> Temp_Loc_Maxs;
 				///==========================================================================================
 				// imge ROI settings: 700, 500  1520, 880 [resolution: 1920 x 1080] 
 				// to divide ROI into small parts, do it here, and setup afterwards. 
 				roi = Rect(Point(ROI_LEFT_X, ROI_LEFT_Y), Point(ROI_RIGHT_X, ROI_RIGHT_Y));
 				// ROI_Image(820 x 380)
-				roiImg = img_roi(roi);     // matching through this part
-				Origin_img = img_roi(roi); // to save COlOR searching part
+				Origin_img = img(roi); // to save COlOR searching part
 				///==========================================================================================
 				
 				///==========================================================================================
 				// Image_Processing(ROI_Image, output_ROI_Image, gamma) 
-				// only operate on ROI (for each video)
-				Image_Processing(roiImg, gamma);
+				// only operate on ROI (for each video), on a continuous copy since mask cannot take the frame's row stride
+				roiImg = ROI_Image_Processing(img, roi, gamma, *arena); // matching through this part
 				// 4 steps of ROI color image (grayscale -> brightness ->  OTSU_Threshold -> Opening_Filtering)
 				///==========================================================================================
 
 				///==========================================================================================
-				// Original template Matching (image-processed ROI image, image-processed template image) 
-				Temp_Loc_Max = ROI_Temp_img(roiImg, templ);
+				// blobs left after the opening are the candidate regions of the template
+				mask roi_mask(&roiImg.data, roiImg.rows, roiImg.cols);
+				roi_mask.set_thread_count(3);
+				std::vector<component> blobs = connected_components(roi_mask);
+				///==========================================================================================
+
+				///==========================================================================================
+				// Candidate template Matching (image-processed ROI image, image-processed template images, blobs) 
+				// the ROI is processed once and shared by every shortlisted template
+				std::vector<Mat> candidates;
+				for (int i : shortlist_templates(roiImg, blobs, templ_index, descriptor_index::maximum_radius, *arena))
+					candidates.push_back(templs[i]);
+				Temp_Loc_Maxs = ROI_Temp_img(roiImg, candidates, blobs, 3, *arena);
 				//std::cout << "score : " << Temp_Loc_Max.Max_score << endl;
 				// calculate score and template point(x,y) output
 				///==========================================================================================
-				// consider only above 90 matching score
-				if (Temp_Loc_Max.Max_score > 90)
+				for (size_t i = 0; i < Temp_Loc_Maxs.size(); ++i)
 				{
-					// if completely elsewhere, ignore
-					if (Roi_point.x - Temp_Loc_Max.matchLoc.x < templ.cols && Roi_point.y - Temp_Loc_Max.matchLoc.y < templ.rows)
+					const RE_Matching& Temp_Loc_Max = Temp_Loc_Maxs[i];
+					// consider only above 90 matching score
+					if (Temp_Loc_Max.Max_score > 90)
 					{
-						// adjust Point 
-						Roi_point = Temp_Loc_Max.matchLoc;
-						///==========================================================================================
-						// draw a box on good Matching
-						// draw a box on image (image, point, other side point, color, thickness, type, shift) 	
-						rectangle(img_display, Point(Temp_Loc_Max.matchLoc.x + ROI_LEFT_X, Temp_Loc_Max.matchLoc.y + ROI_LEFT_Y), Point(Temp_Loc_Max.matchLoc.x + Temp_Loc_Max.re_temp.cols + ROI_LEFT_X, Temp_Loc_Max.matchLoc.y + Temp_Loc_Max.re_temp.rows + ROI_LEFT_Y), Scalar(0, 0, 255), 2, 8, 0);
-						//rectangle(img_display, Point(matchLoc.x, matchLoc.y), Point(matchLoc.x + templ.cols, matchLoc.y + templ.rows), Scalar(0, 0, 255), 2, 8, 0); draw a box on image (image, point, other side point, color, thickness, type, shift) 	
-						///==========================================================================================
-
-						///==========================================================================================
-						// from ROI image, RE_ROI on template part (image that wasn't image-processed)
-						re_roi = Rect(Point(Temp_Loc_Max.matchLoc.x, Temp_Loc_Max.matchLoc.y), Point(Temp_Loc_Max.matchLoc.x + Temp_Loc_Max.re_temp.cols, Temp_Loc_Max.matchLoc.y + Temp_Loc_Max.re_temp.rows));
-						///==========================================================================================
-
+						// if completely elsewhere, ignore
+						if (Roi_point.x - Temp_Loc_Max.matchLoc.x < candidates[i].cols && Roi_point.y - Temp_Loc_Max.matchLoc.y < candidates[i].rows)
+						{
+							// adjust Point 
+							Roi_point = Temp_Loc_Max.matchLoc;
+							///==========================================================================================
+							// draw a box on good Matching
+							// draw a box on image (image, point, other side point, color, thickness, type, shift) 	
+							rectangle(img_display, Point(Temp_Loc_Max.matchLoc.x + ROI_LEFT_X, Temp_Loc_Max.matchLoc.y + ROI_LEFT_Y), Point(Temp_Loc_Max.matchLoc.x + Temp_Loc_Max.re_temp.cols + ROI_LEFT_X, Temp_Loc_Max.matchLoc.y + Temp_Loc_Max.re_temp.rows + ROI_LEFT_Y), Scalar(0, 0, 255), 2, 8, 0);
+							//rectangle(img_display, Point(matchLoc.x, matchLoc.y), Point(matchLoc.x + templ.cols, matchLoc.y + templ.rows), Scalar(0, 0, 255), 2, 8, 0); draw a box on image (image, point, other side point, color, thickness, type, shift) 	
+							///==========================================================================================
+
+							///==========================================================================================
+							// from ROI image, RE_ROI on template part (image that wasn't image-processed)
+							re_roi = Rect(Point(Temp_Loc_Max.matchLoc.x, Temp_Loc_Max.matchLoc.y), Point(Temp_Loc_Max.matchLoc.x + Temp_Loc_Max.re_temp.cols, Temp_Loc_Max.matchLoc.y + Temp_Loc_Max.re_temp.rows));
+							///==========================================================================================
+
+						}
+						// matching count computation
+						run_index++;
 					}
-					// matching count computation
-					run_index++;
 				}
 				// save video
 				//Video_output.write(img_display);
@@ -153,10 +191,10 @@ int main(int argc, char** argv)
 			int x4 = 0, y4 = 360;
 
 			// image ROI setup: [850 x 450 resolution per ROI] [original resolution: 1920 x 1080] 
-			t.run(MatchingMethod, 300, 300, 1150, 750); 
-			t.run(MatchingMethod, 950, 550, 1800,1000);
-			t.run(MatchingMethod, 950, 300, 1800, 750); 
-			t.run(MatchingMethod, 300, 550, 1150, 1000); 
+			roi_task tasks[4] = { { 300, 300, 1150, 750, &roi_arenas[0] }, { 950, 550, 1800, 1000, &roi_arenas[1] },
+			                      { 950, 300, 1800, 750, &roi_arenas[2] }, { 300, 550, 1150, 1000, &roi_arenas[3] } };
+			for (roi_task& task : tasks)
+				t.run(MatchingMethod, &task);
 			t.wait();
 
 			t1 = clock() - t1; 
@@ -172,6 +210,19 @@ int main(int argc, char** argv)
 	}
 	cv::waitKey((((float)t1) / CLOCKS_PER_SEC) * 1000); // time check
 	cap1.release();
+
+	for (scratch_arena& arena : roi_arenas)
+	{
+		scratch_arena::statistics stats = arena.get_statistics();
+		std::cout << "scratch peak " << stats.peak / 1024 << " KB, " << stats.heap_allocations << " heap allocations" << std::endl;
+	}
+
+#ifdef PPFIS_TRACE
+	// per stage timing, open trace.json in chrome://tracing
+	std::ofstream trace_file("trace.json");
+	trace::instance().write_chrome_json(trace_file);
+	trace::instance().write_summary(std::cout);
+#endif
 	///==========================================================================================
 
 	return 0;